@@ -131,7 +131,7 @@ int main() {
     {
       printf("\nTest 5: Software Encode Speed\n");
       uint8_t buffer[64];
-      uint8_t encoded_data[64 * 2 * 7 / 6 + 2];
+      uint8_t encoded_data[64 * 2 * 7 / 6 + 4] __attribute__((aligned(4)));
       for (size_t i = 0; i < sizeof(buffer); i++) {
         buffer[i] = i;
       }
@@ -144,6 +144,51 @@ int main() {
       int64_t diff = absolute_time_diff_us(start, end);
       printf("%f us (64bytes packet)", diff / 1000.0f);
     }
+
+    {
+      printf("\nTest 6: Completion Ring\n");
+
+      root_port_t *root = PIO_USB_ROOT_PORT(0);
+      gpio_pull_up(root->pin_dp);
+      gpio_pull_down(root->pin_dm);
+      root->is_fullspeed = true;
+      root->initialized = true;
+      root->connected = true;
+      root->suspended = false;
+
+      // nobody answers the IN token, transfer completes with error
+      static uint8_t rx_data[8];
+      endpoint_t *ep = PIO_USB_ENDPOINT(0);
+      ep->root_idx = 0;
+      ep->dev_addr = 1;
+      ep->ep_num = 0x81;
+      ep->attr = EP_ATTR_BULK;
+      ep->size = 8;
+      ep->is_tx = false;
+      ep->has_transfer = false;
+      pio_usb_ll_transfer_start(ep, rx_data, sizeof(rx_data));
+
+      for (int i = 0; i < 8 && ep->has_transfer; i++) {
+        uint32_t irq = save_and_disable_interrupts();
+        pio_usb_host_frame();
+        restore_interrupts(irq);
+      }
+      pio_usb_ll_transfer_cancel(ep);
+
+      pio_usb_completion_t recs[8];
+      uint8_t const cnt =
+          pio_usb_host_get_completions(0, recs, sizeof(recs) / sizeof(recs[0]));
+      for (uint8_t i = 0; i < cnt; i++) {
+        printf("ep %u flag %02x len %u frame %lu\n", recs[i].ep_idx,
+               recs[i].flag, recs[i].actual_len, (unsigned long)recs[i].frame);
+      }
+      printf("%s\n", (cnt == 1 && recs[0].ep_idx == 0 &&
+                       recs[0].flag == PIO_USB_INTS_ENDPOINT_ERROR_BITS)
+                          ? "[OK]"
+                          : "[NG]");
+
+      root->connected = false;
+    }
   }
 }
 
@@ -164,7 +209,8 @@ static bool do_test(pio_port_t *pp) {
 
   uint32_t irq = save_and_disable_interrupts();
   // Start transmitter
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_usb_transfer(pp, ep->encoded_data[ep->buffer_idx],
+                           ep->encoded_data_len[ep->buffer_idx]);
   restore_interrupts(irq);
 
   // Check received data
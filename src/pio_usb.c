@@ -30,13 +30,17 @@
 
 usb_device_t pio_usb_device[PIO_USB_DEVICE_CNT];
 pio_port_t pio_port[1];
+
+// Guards root_port_t::ep_active, which is updated from the frame ISR and
+// from transfer submission possibly running on the other core
+static spin_lock_t *ep_active_lock;
 root_port_t pio_usb_root_port[PIO_USB_ROOT_PORT_CNT];
 endpoint_t pio_usb_ep_pool[PIO_USB_EP_POOL_CNT];
 
-static uint8_t ack_encoded[5];
-static uint8_t nak_encoded[5];
-static uint8_t stall_encoded[5];
-static uint8_t pre_encoded[5];
+// slot 1 of the TX ping-pong, held by one endpoint at a time
+static uint8_t tx_next_buffer[sizeof(((endpoint_t *)0)->buffer)]
+    __attribute__((aligned(4)));
+static endpoint_t *volatile tx_next_owner;
 
 //--------------------------------------------------------------------+
 // Bus functions
@@ -49,9 +53,10 @@ static void __no_inline_not_in_flash_func(send_pre)(const pio_port_t *pp) {
 
   SM_SET_CLKDIV(pp->pio_usb_tx, pp->sm_tx, pp->clk_div_fs_tx);
 
-  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
-  dma_channel_transfer_from_buffer_now(pp->tx_ch, pre_encoded,
-                                       sizeof(pre_encoded));
+  pio_usb_bus_start_tx(pp);
+  dma_channel_transfer_from_buffer_now(
+      pp->tx_ch, pio_usb_const_packet[PIO_USB_PACKET_PRE].encoded,
+      pio_usb_ll_const_packet_len(pp, PIO_USB_PACKET_PRE) >> pp->tx_len_shift);
   pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK;       // clear complete flag
 
   while ((pp->pio_usb_tx->irq & IRQ_TX_EOP_MASK) == 0) {
@@ -76,13 +81,15 @@ static void __no_inline_not_in_flash_func(send_pre)(const pio_port_t *pp) {
 }
 
 void __not_in_flash_func(pio_usb_bus_usb_transfer)(const pio_port_t *pp,
-                                              uint8_t *data, uint16_t len) {
+                                                   const uint8_t *data,
+                                                   uint16_t len) {
   if (pp->need_pre) {
     send_pre(pp);
   }
 
-  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
-  dma_channel_transfer_from_buffer_now(pp->tx_ch, data, len);
+  pio_usb_bus_start_tx(pp);
+  dma_channel_transfer_from_buffer_now(pp->tx_ch, data,
+                                       len >> pp->tx_len_shift);
   pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
 
   io_ro_32 *pc = &pp->pio_usb_tx->sm[pp->sm_tx].addr;
@@ -97,20 +104,24 @@ void __not_in_flash_func(pio_usb_bus_usb_transfer)(const pio_port_t *pp,
 
 void __no_inline_not_in_flash_func(pio_usb_bus_send_handshake)(
     const pio_port_t *pp, uint8_t pid) {
+  uint8_t id;
   switch (pid) {
   case USB_PID_ACK:
-    pio_usb_bus_usb_transfer(pp, ack_encoded, 5);
+    id = PIO_USB_PACKET_ACK;
     break;
 
   case USB_PID_NAK:
-    pio_usb_bus_usb_transfer(pp, nak_encoded, 5);
+    id = PIO_USB_PACKET_NAK;
     break;
 
   case USB_PID_STALL:
   default:
-    pio_usb_bus_usb_transfer(pp, stall_encoded, 5);
+    id = PIO_USB_PACKET_STALL;
     break;
   }
+
+  pio_usb_bus_usb_transfer(pp, pio_usb_const_packet[id].encoded,
+                           pio_usb_ll_const_packet_len(pp, id));
 }
 
 void __no_inline_not_in_flash_func(pio_usb_bus_send_token)(const pio_port_t *pp,
@@ -118,14 +129,9 @@ void __no_inline_not_in_flash_func(pio_usb_bus_send_token)(const pio_port_t *pp,
                                                            uint8_t addr,
                                                            uint8_t ep_num) {
 
-  uint8_t packet[4] = {USB_SYNC, token, 0, 0};
-  uint16_t dat = ((uint16_t)(ep_num & 0xf) << 7) | (addr & 0x7f);
-  uint8_t crc = calc_usb_crc5(dat);
-  packet[2] = dat & 0xff;
-  packet[3] = (crc << 3) | ((dat >> 8) & 0x1f);
-
-  uint8_t packet_encoded[sizeof(packet) * 2 * 7 / 6 + 2];
-  uint8_t encoded_len = pio_usb_ll_encode_tx_data(packet, sizeof(packet), packet_encoded);
+  uint8_t packet_encoded[4 * 2 * 7 / 6 + 3] __attribute__((aligned(4)));
+  uint8_t encoded_len =
+      pio_usb_ll_encode_token(token, addr, ep_num, packet_encoded);
 
   pio_usb_bus_usb_transfer(pp, packet_encoded, encoded_len);
 }
@@ -143,21 +149,34 @@ void __no_inline_not_in_flash_func(pio_usb_bus_start_receive)(const pio_port_t *
   pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
 }
 
+// Timer counts 1us regardless of clk_sys. More than rx_timeout_us ticks
+// since start guarantees that the full timeout has passed.
+static __always_inline bool rx_timeout(const pio_port_t *pp, uint32_t start) {
+  return timer_hw->timerawl - start > pp->rx_timeout_us;
+}
+
+// Response timeout plus the time of a packet which fills usb_rx_buffer with
+// worst case bit stuffing. A packet still running then is babble.
+static __always_inline uint32_t rx_packet_timeout_us(const pio_port_t *pp) {
+  uint32_t const packet_bits = sizeof(pp->usb_rx_buffer) * 8 * 7 / 6;
+  return pp->rx_timeout_us * (PIO_USB_RX_TIMEOUT_BITS + packet_bits) /
+         PIO_USB_RX_TIMEOUT_BITS;
+}
+
 uint8_t __no_inline_not_in_flash_func(pio_usb_bus_wait_handshake)(pio_port_t* pp) {
-  int16_t t = 240;
+  uint32_t const start = timer_hw->timerawl;
   int16_t idx = 0;
 
-  while (t--) {
+  while (idx < 2) {
     if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
       uint8_t data = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
       pp->usb_rx_buffer[idx++] = data;
-      if (idx == 2) {
-        break;
-      }
+    } else if (rx_timeout(pp, start)) {
+      break;
     }
   }
 
-  if (t > 0) {
+  if (idx == 2) {
     while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
       continue;
     }
@@ -168,45 +187,245 @@ uint8_t __no_inline_not_in_flash_func(pio_usb_bus_wait_handshake)(pio_port_t* pp
   return pp->usb_rx_buffer[1];
 }
 
-int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
+// Decoder found a bit stuffing error. Packet is broken and not handshaked,
+// wait until the sender finishes it so that the bus is idle on return.
+static int __no_inline_not_in_flash_func(receive_bs_error)(pio_port_t *pp) {
+  pp->rx_bs_err_cnt++;
+  while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+    continue;
+  }
+  pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
+
+  return PIO_USB_RX_ERR_BS;
+}
+
+// RX FIFO is drained into usb_rx_buffer by DMA. CPU only follows the DMA
+// write position to keep CRC16 ready for the handshake turnaround.
+static int __no_inline_not_in_flash_func(receive_packet_dma_and_handshake)(
+    pio_port_t *pp, uint8_t handshake) {
+  io_rw_32 *transfer_count = &dma_channel_hw_addr(pp->rx_ch)->transfer_count;
+  uint32_t const start = timer_hw->timerawl;
+  uint16_t crc = 0xffff;
+  uint16_t idx = 2;
+  uint16_t received = 0;
+
+  dma_channel_transfer_to_buffer_now(pp->rx_ch, pp->usb_rx_buffer,
+                                     sizeof(pp->usb_rx_buffer));
+
+  while (received < 2 && !rx_timeout(pp, start)) {
+    received = sizeof(pp->usb_rx_buffer) - *transfer_count;
+  }
+
+  // timing critical start
+  if (received >= 2) {
+    if (handshake == USB_PID_ACK) {
+      uint32_t const packet_timeout_us = rx_packet_timeout_us(pp);
+      while ((pp->pio_usb_rx->irq & IRQ_RX_END_MASK) == 0) {
+        // the last counted byte may still be on its way to memory
+        received = sizeof(pp->usb_rx_buffer) - *transfer_count;
+        __compiler_memory_barrier();
+        while (idx + 1 < received) {
+          crc = update_usb_crc16(crc, pp->usb_rx_buffer[idx++]);
+        }
+        if (timer_hw->timerawl - start > packet_timeout_us) {
+          dma_channel_abort(pp->rx_ch);
+          return -1; // babble
+        }
+      }
+      if (pp->pio_usb_rx->irq & IRQ_RX_BS_ERR_MASK) {
+        dma_channel_abort(pp->rx_ch);
+        return receive_bs_error(pp);
+      }
+
+      while (!pio_sm_is_rx_fifo_empty(pp->pio_usb_rx, pp->sm_rx) &&
+             *transfer_count) {
+        continue;
+      }
+      dma_channel_abort(pp->rx_ch);
+      received = sizeof(pp->usb_rx_buffer) - *transfer_count;
+      __compiler_memory_barrier();
+      while (idx < received) {
+        crc = update_usb_crc16(crc, pp->usb_rx_buffer[idx++]);
+      }
+
+      if (idx >= 4 && crc == USB_CRC16_RESIDUE) {
+        pio_usb_bus_send_handshake(pp, USB_PID_ACK);
+        // timing critical end
+        return idx - 4;
+      }
+    } else {
+      // just discard received data since we NAK/STALL anyway
+      while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+        continue;
+      }
+      dma_channel_abort(pp->rx_ch);
+      pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
+
+      pio_usb_bus_send_handshake(pp, handshake);
+    }
+  } else {
+    dma_channel_abort(pp->rx_ch);
+  }
+
+  return -1;
+}
+
+// Push bits left in ISR at EOP. Return the threshold which pushed them, 0 if
+// less than a byte is left.
+static __always_inline uint8_t push_rx_tail(pio_port_t *pp,
+                                            uint32_t shiftctrl_word) {
+  io_rw_32 *shiftctrl = &pp->pio_usb_rx->sm[pp->sm_rx].shiftctrl;
+
+  for (int i = 0; i < PIO_USB_RX_TAIL_PROBE_CNT; i++) {
+    uint8_t const bits = pio_usb_rx_tail_probe[i];
+    *shiftctrl =
+        shiftctrl_word | ((uint32_t)bits << PIO_SM0_SHIFTCTRL_PUSH_THRESH_LSB);
+    pio_sm_exec(pp->pio_usb_rx, pp->sm_rx, pio_encode_push(true, false));
+    if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
+      return bits;
+    }
+  }
+
+  return 0;
+}
+
+// Decoder pushes 32bit words while a data packet is received, so the CPU
+// reads FIFO and updates CRC16 once per 4 bytes
+static int __no_inline_not_in_flash_func(receive_packet_word_and_handshake)(
     pio_port_t *pp, uint8_t handshake) {
+  io_rw_32 *shiftctrl = &pp->pio_usb_rx->sm[pp->sm_rx].shiftctrl;
+  uint32_t const shiftctrl_byte = *shiftctrl;
+  uint32_t const shiftctrl_word =
+      shiftctrl_byte & ~PIO_SM0_SHIFTCTRL_PUSH_THRESH_BITS; // 0 means 32
+  uint32_t const start = timer_hw->timerawl;
+  uint8_t *buffer = pp->usb_rx_buffer;
   uint16_t crc = 0xffff;
-  uint16_t crc_prev = 0xffff;
-  uint16_t crc_prev2 = 0xffff;
-  uint16_t crc_receive = 0xffff;
-  uint16_t crc_receive_inverse;
-  bool crc_match = false;
-  int16_t t = 240;
+  bool timeout = false;
   uint16_t idx = 0;
+  int res = -1;
+
+  *shiftctrl = shiftctrl_word;
+  // entries pushed before the switch hold a byte each
+  for (uint8_t level = pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx);
+       level; level--) {
+    buffer[idx++] = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
+  }
 
-  while (t--) {
+  while (idx < 2) {
     if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
-      uint8_t data = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
-      pp->usb_rx_buffer[idx++] = data;
-      if (idx == 2) {
-        break;
-      }
+      idx = pio_usb_ll_decode_rx_word(
+          buffer, sizeof(pp->usb_rx_buffer), idx,
+          pio_sm_get(pp->pio_usb_rx, pp->sm_rx), &crc);
+    } else if (pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) {
+      break; // shorter than a word, e.g. NAK
+    } else if (rx_timeout(pp, start)) {
+      timeout = true;
+      break;
     }
   }
 
   // timing critical start
-  if (t > 0) {
+  if (!timeout) {
     if (handshake == USB_PID_ACK) {
+      uint32_t const packet_timeout_us = rx_packet_timeout_us(pp);
+      bool end;
+      do {
+        // words pushed before EOP flag are in FIFO when it is seen
+        end = pp->pio_usb_rx->irq & IRQ_RX_END_MASK;
+        while (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
+          idx = pio_usb_ll_decode_rx_word(
+              buffer, sizeof(pp->usb_rx_buffer), idx,
+              pio_sm_get(pp->pio_usb_rx, pp->sm_rx), &crc);
+        }
+        if (!end && timer_hw->timerawl - start > packet_timeout_us) {
+          timeout = true; // babble
+          break;
+        }
+      } while (!end);
+
+      if (timeout) {
+        // no EOP, not acknowledged
+      } else if (pp->pio_usb_rx->irq & IRQ_RX_BS_ERR_MASK) {
+        res = receive_bs_error(pp);
+      } else {
+        uint8_t const bits = push_rx_tail(pp, shiftctrl_word);
+        if (bits) {
+          idx = pio_usb_ll_decode_rx_tail(
+              buffer, sizeof(pp->usb_rx_buffer), idx,
+              pio_sm_get(pp->pio_usb_rx, pp->sm_rx), bits, &crc);
+        }
+
+        // longer than usb_rx_buffer is rejected, its tail was not stored
+        if (idx >= 4 && idx <= sizeof(pp->usb_rx_buffer) &&
+            crc == USB_CRC16_RESIDUE) {
+          pio_usb_bus_send_handshake(pp, USB_PID_ACK);
+          // timing critical end
+          res = idx - 4;
+        }
+      }
+    } else {
+      // just discard received data since we NAK/STALL anyway
       while ((pp->pio_usb_rx->irq & IRQ_RX_COMP_MASK) == 0) {
+        continue;
+      }
+      pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
+
+      pio_usb_bus_send_handshake(pp, handshake);
+    }
+  }
+
+  *shiftctrl = shiftctrl_byte;
+
+  return res;
+}
+
+int __no_inline_not_in_flash_func(pio_usb_bus_receive_packet_and_handshake)(
+    pio_port_t *pp, uint8_t handshake, uint8_t *buffer, uint16_t buffer_len) {
+  uint16_t crc = 0xffff;
+  uint16_t crc_field = 0;
+  uint16_t idx = 0;
+
+  if ((pp->rx_ch >= 0 || pp->rx_word) && handshake != PIO_USB_NO_HANDSHAKE) {
+    // these modes receive whole packet into usb_rx_buffer and copy the
+    // payload, isochronous packets may not fit and take the byte path
+    int const res = pp->rx_ch >= 0
+                        ? receive_packet_dma_and_handshake(pp, handshake)
+                        : receive_packet_word_and_handshake(pp, handshake);
+    if (res > 0) {
+      memcpy(buffer, &pp->usb_rx_buffer[2],
+             res < buffer_len ? res : buffer_len);
+    }
+    return res;
+  }
+
+  uint32_t const start = timer_hw->timerawl;
+  while (idx < 2) {
+    if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
+      uint8_t data = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
+      pp->usb_rx_buffer[idx++] = data;
+    } else if (rx_timeout(pp, start)) {
+      break;
+    }
+  }
+
+  // timing critical start
+  if (idx == 2) {
+    if (handshake == USB_PID_ACK || handshake == PIO_USB_NO_HANDSHAKE) {
+      while ((pp->pio_usb_rx->irq & IRQ_RX_END_MASK) == 0) {
         if (pio_sm_get_rx_fifo_level(pp->pio_usb_rx, pp->sm_rx)) {
           uint8_t data = pio_sm_get(pp->pio_usb_rx, pp->sm_rx) >> 24;
-          crc_prev2 = crc_prev;
-          crc_prev = crc;
-          crc = update_usb_crc16(crc, data);
-          pp->usb_rx_buffer[idx++] = data;
-          crc_receive = (crc_receive >> 8) | (data << 8);
-          crc_receive_inverse = crc_receive ^ 0xffff;
-          crc_match = (crc_receive_inverse == crc_prev2);
+          idx = pio_usb_ll_receive_data_byte(buffer, buffer_len, idx, data,
+                                             &crc, &crc_field);
         }
       }
+      if (pp->pio_usb_rx->irq & IRQ_RX_BS_ERR_MASK) {
+        return receive_bs_error(pp);
+      }
 
-      if (idx >= 4 && crc_match) {
-        pio_usb_bus_send_handshake(pp, USB_PID_ACK);
+      if (idx >= 4 && crc == USB_CRC16_RESIDUE) {
+        if (handshake == USB_PID_ACK) {
+          pio_usb_bus_send_handshake(pp, USB_PID_ACK);
+        }
         // timing critical end
         return idx - 4;
       }
@@ -241,21 +460,32 @@ static void __no_inline_not_in_flash_func(initialize_host_programs)(
   pio_add_program_at_offset(pp->pio_usb_tx, pp->fs_tx_program, 0);
   pp->offset_tx = 0;
   usb_tx_fs_program_init(pp->pio_usb_tx, pp->sm_tx, pp->offset_tx, port->pin_dp,
-                         port->pin_dm);
+                         port->pin_dm, c->tx_dma_word ? 32 : 8);
   pp->tx_start_instr = pio_encode_jmp(pp->offset_tx + 4);
   pp->tx_reset_instr = pio_encode_jmp(pp->offset_tx + 2);
 
-  add_pio_host_rx_program(pp->pio_usb_rx, &usb_nrzi_decoder_program,
-                          &usb_nrzi_decoder_debug_program, &pp->offset_rx,
-                          c->debug_pin_rx);
-  usb_rx_fs_program_init(pp->pio_usb_rx, pp->sm_rx, pp->offset_rx, port->pin_dp,
-                         port->pin_dm, c->debug_pin_rx);
-  pp->rx_reset_instr = pio_encode_jmp(pp->offset_rx);
-  pp->rx_reset_instr2 = pio_encode_set(pio_x, 0);
-
   add_pio_host_rx_program(pp->pio_usb_rx, &usb_edge_detector_program,
                           &usb_edge_detector_debug_program, &pp->offset_eop,
                           c->debug_pin_eop);
+
+  // Decoder with bit stuffing check only fits if TX is on the other PIO
+  bool const bs_check =
+      c->debug_pin_rx < 0 &&
+      pio_can_add_program(pp->pio_usb_rx, &usb_nrzi_decoder_bs_program);
+  uint rx_start = 0;
+  if (bs_check) {
+    pp->offset_rx = pio_add_program(pp->pio_usb_rx, &usb_nrzi_decoder_bs_program);
+    rx_start = usb_nrzi_decoder_bs_offset_start;
+  } else {
+    add_pio_host_rx_program(pp->pio_usb_rx, &usb_nrzi_decoder_program,
+                            &usb_nrzi_decoder_debug_program, &pp->offset_rx,
+                            c->debug_pin_rx);
+  }
+  usb_rx_fs_program_init(pp->pio_usb_rx, pp->sm_rx, pp->offset_rx, port->pin_dp,
+                         port->pin_dm, c->debug_pin_rx, bs_check);
+  pp->rx_reset_instr = pio_encode_jmp(pp->offset_rx + rx_start);
+  pp->rx_reset_instr2 = pio_encode_set(pio_x, 0);
+
   eop_detect_fs_program_init(pp->pio_usb_rx, c->sm_eop, pp->offset_eop,
                              port->pin_dp, port->pin_dm, true,
                              c->debug_pin_eop);
@@ -267,18 +497,37 @@ static void __no_inline_not_in_flash_func(initialize_host_programs)(
   pio_sm_set_in_pins(pp->pio_usb_rx, pp->sm_eop, port->pin_dp);
 }
 
-static void configure_tx_channel(uint8_t ch, PIO pio, uint sm) {
+static void configure_tx_channel(uint8_t ch, PIO pio, uint sm, bool word) {
   dma_channel_config conf = dma_channel_get_default_config(ch);
 
   channel_config_set_read_increment(&conf, true);
   channel_config_set_write_increment(&conf, false);
-  channel_config_set_transfer_data_size(&conf, DMA_SIZE_8);
+  if (word) {
+    // TX SM shifts to left, swap bytes so that the first byte goes out first
+    channel_config_set_transfer_data_size(&conf, DMA_SIZE_32);
+    channel_config_set_bswap(&conf, true);
+  } else {
+    channel_config_set_transfer_data_size(&conf, DMA_SIZE_8);
+  }
   channel_config_set_dreq(&conf, pio_get_dreq(pio, sm, true));
 
   dma_channel_set_config(ch, &conf, false);
   dma_channel_set_write_addr(ch, &pio->txf[sm], false);
 }
 
+static void configure_rx_channel(uint8_t ch, PIO pio, uint sm) {
+  dma_channel_config conf = dma_channel_get_default_config(ch);
+
+  channel_config_set_read_increment(&conf, false);
+  channel_config_set_write_increment(&conf, true);
+  channel_config_set_transfer_data_size(&conf, DMA_SIZE_8);
+  channel_config_set_dreq(&conf, pio_get_dreq(pio, sm, false));
+
+  // RX SM shifts to right, received byte is in the MSB lane of FIFO
+  dma_channel_set_config(ch, &conf, false);
+  dma_channel_set_read_addr(ch, (io_ro_8 *)&pio->rxf[sm] + 3, false);
+}
+
 static void apply_config(pio_port_t *pp, const pio_usb_configuration_t *c,
                          root_port_t *port) {
   pp->pio_usb_tx = c->pio_tx_num == 0 ? pio0 : pio1;
@@ -323,7 +572,19 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
 
   pp->pio_usb_tx = c->pio_tx_num == 0 ? pio0 : pio1;
   dma_claim_mask(1<<c->tx_ch);
-  configure_tx_channel(c->tx_ch, pp->pio_usb_tx, c->sm_tx);
+  configure_tx_channel(c->tx_ch, pp->pio_usb_tx, c->sm_tx, c->tx_dma_word);
+  pp->tx_len_shift = c->tx_dma_word ? 2 : 0;
+
+  // RX DMA is opt in, a channel shared with TX is taken as not configured
+  bool const rx_dma = c->rx_dma && c->rx_ch != c->tx_ch;
+  pp->rx_ch = rx_dma ? c->rx_ch : -1;
+  pp->rx_word = c->rx_word;
+  pp->rx_timeout_us = PIO_USB_RX_TIMEOUT_FS_US;
+  if (rx_dma) {
+    dma_claim_mask(1 << c->rx_ch);
+    configure_rx_channel(c->rx_ch, c->pio_rx_num == 0 ? pio0 : pio1,
+                         c->sm_rx);
+  }
 
   apply_config(pp, c, root);
   initialize_host_programs(pp, c, root);
@@ -331,15 +592,11 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
   root->initialized = true;
   root->dev_addr = 0;
 
-  // pre-encode handshake packets
-  uint8_t raw_packet[] = {USB_SYNC, USB_PID_ACK};
-  pio_usb_ll_encode_tx_data(raw_packet, 2, ack_encoded);
-  raw_packet[1] = USB_PID_NAK;
-  pio_usb_ll_encode_tx_data(raw_packet, 2, nak_encoded);
-  raw_packet[1] = USB_PID_STALL;
-  pio_usb_ll_encode_tx_data(raw_packet, 2, stall_encoded);
-  raw_packet[1] = USB_PID_PRE;
-  pio_usb_ll_encode_tx_data(raw_packet, 2, pre_encoded);
+  pio_usb_ll_encode_tx_init(c->tx_dma_word);
+
+  if (ep_active_lock == NULL) {
+    ep_active_lock = spin_lock_instance(spin_lock_claim_unused(true));
+  }
 }
 
 //--------------------------------------------------------------------+
@@ -385,6 +642,10 @@ int __no_inline_not_in_flash_func(pio_usb_set_out_data)(endpoint_t *ep,
   return pio_usb_ll_transfer_start(ep, (uint8_t *)buffer, len) ? 0 : -1;
 }
 
+uint32_t pio_usb_get_bs_err_count(void) {
+  return PIO_USB_PIO_PORT(0)->rx_bs_err_cnt;
+}
+
 //--------------------------------------------------------------------+
 // Low Level Function
 //--------------------------------------------------------------------+
@@ -396,103 +657,106 @@ void __no_inline_not_in_flash_func(pio_usb_ll_configure_endpoint)(
   ep->ep_num = d->epaddr;
   ep->attr = d->attr;
   ep->interval = d->interval;
-  ep->interval_counter = 0;
+  ep->interval_phase = 0;
   ep->data_id = 0;
 }
 
-// Encode transfer data to 2bit sequence represents TX PIO instruction address
-uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
-    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
-  uint16_t bit_idx = 0;
-  int current_state = 1;
-  int bit_stuffing = 6;
-  for (int idx = 0; idx < buffer_len; idx++) {
-    uint8_t byte = buffer[idx];
-    for (int b = 0; b < 8; b++) {
-      uint8_t byte_idx = bit_idx >> 2;
-      encoded_data[byte_idx] <<= 2;
-      if (byte & (1 << b)) {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-        }
-        bit_stuffing--;
-      } else {
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
-      }
+static inline __force_inline uint8_t tx_data_pid(uint8_t data_id) {
+  return (data_id == 1) ? USB_PID_DATA1
+                        : USB_PID_DATA0; // USB_PID_SETUP also DATA0
+}
 
-      bit_idx++;
+static inline __force_inline void encode_tx_data(endpoint_t *ep, uint8_t idx,
+                                                 uint8_t data_id,
+                                                 uint8_t const *data,
+                                                 uint16_t len) {
+  if (len == 0) {
+    // zero length packet is prebuilt
+    uint8_t const id = (data_id == 1) ? PIO_USB_PACKET_DATA1_ZLP
+                                      : PIO_USB_PACKET_DATA0_ZLP;
+    ep->encoded_data[idx] = pio_usb_const_packet[id].encoded;
+    ep->encoded_data_len[idx] =
+        pio_usb_ll_const_packet_len(PIO_USB_PIO_PORT(0), id);
+  } else {
+    uint8_t *buffer = idx ? tx_next_buffer : ep->buffer;
+    ep->encoded_data_len[idx] = pio_usb_ll_encode_tx_packet(
+        tx_data_pid(data_id), data, len, buffer);
+    ep->encoded_data[idx] = buffer;
+  }
+}
 
-      if (bit_stuffing == 0) {
-        byte_idx = bit_idx >> 2;
-        encoded_data[byte_idx] <<= 2;
+static inline __force_inline bool claim_tx_next(endpoint_t *ep) {
+  if (tx_next_owner == ep) {
+    return true;
+  }
 
-        if (current_state) {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
-          current_state = 0;
-        } else {
-          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-          current_state = 1;
-        }
-        bit_stuffing = 6;
-        bit_idx++;
-      }
-    }
+  uint32_t const save = spin_lock_blocking(ep_active_lock);
+  bool const claimed = (tx_next_owner == NULL);
+  if (claimed) {
+    tx_next_owner = ep;
   }
+  spin_unlock(ep_active_lock, save);
 
-  uint8_t byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_SE0;
-  bit_idx++;
+  return claimed;
+}
 
-  byte_idx = bit_idx >> 2;
-  encoded_data[byte_idx] <<= 2;
-  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_COMP;
-  bit_idx++;
+static inline __force_inline void release_tx_next(endpoint_t *ep) {
+  if (tx_next_owner == ep) {
+    tx_next_owner = NULL;
+  }
+}
 
-  // terminate buffers with K
-  do {
-    byte_idx = bit_idx >> 2;
-    encoded_data[byte_idx] <<= 2;
-    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
-    bit_idx++;
-  } while (bit_idx & 0x03);
+static inline __force_inline void prepare_tx_data(endpoint_t *ep) {
+  uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
 
-  byte_idx = bit_idx >> 2;
-  return byte_idx;
+  // packet before was sent, own buffer is used again
+  ep->buffer_idx = 0;
+  release_tx_next(ep);
+  encode_tx_data(ep, 0, ep->data_id, ep->app_buf, xact_len);
+  ep->next_prepared = false;
 }
 
-static inline __force_inline void prepare_tx_data(endpoint_t *ep) {
+// Encode the packet following the current one into the other buffer, so that
+// pio_usb_ll_transfer_continue() only has to switch buffers
+void __no_inline_not_in_flash_func(pio_usb_ll_prepare_next_tx)(endpoint_t *ep) {
+  if (!ep->is_tx || ep->next_prepared || ep->data_id == USB_PID_SETUP) {
+    return;
+  }
+
   uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
-  uint8_t buffer[PIO_USB_EP_SIZE + 4];
-  buffer[0] = USB_SYNC;
-  buffer[1] = (ep->data_id == 1) ? USB_PID_DATA1
-                                 : USB_PID_DATA0; // USB_PID_SETUP also DATA0
-  memcpy(buffer + 2, ep->app_buf, xact_len);
+  uint16_t const next_offset = ep->actual_len + xact_len;
+  if ((xact_len < ep->size) || (next_offset >= ep->total_len)) {
+    return; // current packet is the last one
+  }
 
-  uint16_t const crc16 = calc_usb_crc16(ep->app_buf, xact_len);
-  buffer[2 + xact_len] = crc16 & 0xff;
-  buffer[2 + xact_len + 1] = crc16 >> 8;
+  uint16_t const remaining = ep->total_len - next_offset;
+  uint16_t const next_len = (remaining < ep->size) ? remaining : ep->size;
+  uint8_t const idx = ep->buffer_idx ^ 1;
+  if (idx == 1 && !claim_tx_next(ep)) {
+    return; // another endpoint holds it, encoded after ACK instead
+  }
 
-  ep->encoded_data_len =
-      pio_usb_ll_encode_tx_data(buffer, xact_len + 4, ep->buffer);
+  encode_tx_data(ep, idx, ep->data_id ^ 1, ep->app_buf + xact_len, next_len);
+  ep->next_prepared = true;
 }
 
-bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
-                                                              uint8_t *buffer,
-                                                              uint16_t buflen) {
-  if (ep->has_transfer) {
-    return false;
+static __always_inline void update_ep_active(endpoint_t *ep, bool active) {
+  root_port_t *rport = PIO_USB_ROOT_PORT(ep->root_idx);
+  uint32_t const ep_mask = (1u << (ep - pio_usb_ep_pool));
+  uint32_t const save = spin_lock_blocking(ep_active_lock);
+
+  if (active) {
+    rport->ep_active |= ep_mask;
+  } else {
+    rport->ep_active &= ~ep_mask;
   }
 
+  spin_unlock(ep_active_lock, save);
+}
+
+static inline __force_inline void transfer_setup(endpoint_t *ep,
+                                                 uint8_t *buffer,
+                                                 uint16_t buflen) {
   ep->app_buf = buffer;
   ep->total_len = buflen;
   ep->actual_len = 0;
@@ -505,7 +769,40 @@ bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
 
   ep->transfer_started = false;
   ep->transfer_aborted = false;
+
+  // before has_transfer is set, so frame ISR does not encode concurrently
+  pio_usb_ll_prepare_next_tx(ep);
+}
+
+bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_start)(endpoint_t *ep,
+                                                              uint8_t *buffer,
+                                                              uint16_t buflen) {
+  if (ep->has_transfer) {
+    return false;
+  }
+
+  transfer_setup(ep, buffer, buflen);
+
   ep->has_transfer = true;
+  update_ep_active(ep, true);
+
+  return true;
+}
+
+// Queue desc on ep. It starts at once if ep is idle, otherwise right after
+// the previous descriptor completes, within the same frame.
+bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_enqueue)(
+    endpoint_t *ep, pio_usb_xfer_desc_t *desc) {
+  bool start;
+  if (!pio_usb_ll_xfer_queue_add(ep, ep_active_lock, desc, &start)) {
+    return false; // transfer of pio_usb_ll_transfer_start() in progress
+  }
+
+  if (start) {
+    transfer_setup(ep, desc->buf, desc->len);
+    ep->has_transfer = true;
+    update_ep_active(ep, true);
+  }
 
   return true;
 }
@@ -522,18 +819,64 @@ bool __no_inline_not_in_flash_func(pio_usb_ll_transfer_continue)(
     return false;
   } else {
     if (ep->is_tx) {
-      prepare_tx_data(ep);
+      if (ep->next_prepared) {
+        ep->buffer_idx ^= 1;
+        ep->next_prepared = false;
+        if (ep->buffer_idx == 0) {
+          release_tx_next(ep);
+        }
+      } else {
+        prepare_tx_data(ep);
+      }
     }
 
     return true;
   }
 }
 
+static inline __force_inline void push_completion(root_port_t *rport,
+                                                  endpoint_t *ep,
+                                                  uint32_t flag,
+                                                  uint16_t actual_len) {
+#if PIO_USB_COMPLETION_RING_CNT
+  // Host only, completions come from the frame ISR as the single producer
+  if (rport->mode == PIO_USB_MODE_HOST) {
+    pio_usb_completion_t const rec = {ep - pio_usb_ep_pool, flag, actual_len,
+                                      pio_usb_host_get_frame_number()};
+    pio_usb_ll_completion_push(rport, &rec);
+  }
+#else
+  (void)rport;
+  (void)ep;
+  (void)flag;
+  (void)actual_len;
+#endif
+}
+
 void __no_inline_not_in_flash_func(pio_usb_ll_transfer_complete)(
     endpoint_t *ep, uint32_t flag) {
   root_port_t *rport = PIO_USB_ROOT_PORT(ep->root_idx);
   uint32_t const ep_mask = (1u << (ep - pio_usb_ep_pool));
 
+  // Queued transfer: the next descriptor is set up before the callback, so
+  // ep stays active. Reported to the descriptor callback and the ring only.
+  pio_usb_xfer_desc_t *next;
+  pio_usb_xfer_desc_t *flushed;
+  release_tx_next(ep); // packet in slot 1 is done
+  pio_usb_xfer_desc_t *done = pio_usb_ll_xfer_queue_complete(
+      ep, ep_active_lock, rport, ep_mask, flag, &next, &flushed);
+  if (done) {
+    if (next) {
+      transfer_setup(ep, next->buf, next->len);
+    }
+    push_completion(rport, ep, flag, done->actual_len);
+    for (pio_usb_xfer_desc_t *desc = flushed; desc; desc = desc->next) {
+      push_completion(rport, ep, flag, 0);
+    }
+    pio_usb_ll_xfer_queue_notify(done, flushed);
+    return;
+  }
+
   rport->ints |= flag;
 
   if (flag == PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
@@ -549,7 +892,34 @@ void __no_inline_not_in_flash_func(pio_usb_ll_transfer_complete)(
     // something wrong
   }
 
+  push_completion(rport, ep, flag, ep->actual_len);
+
+  ep->has_transfer = false;
+  update_ep_active(ep, false);
+}
+
+// Drop the transfer without completion report
+void __no_inline_not_in_flash_func(pio_usb_ll_transfer_cancel)(
+    endpoint_t *ep) {
+  // queued descriptors are dropped without callback
+  uint32_t const save = spin_lock_blocking(ep_active_lock);
+  ep->xfer_head = NULL;
+  ep->xfer_tail = NULL;
+  spin_unlock(ep_active_lock, save);
+  release_tx_next(ep);
+
   ep->has_transfer = false;
+  update_ep_active(ep, false);
+}
+
+// Keep ep scheduled every frame until cancelled, for isochronous streams
+// whose data is in ep->iso_ring
+void __no_inline_not_in_flash_func(pio_usb_ll_transfer_stream)(
+    endpoint_t *ep) {
+  ep->transfer_started = false;
+  ep->transfer_aborted = false;
+  ep->has_transfer = true;
+  update_ep_active(ep, true);
 }
 
 int pio_usb_host_add_port(uint8_t pin_dp, PIO_USB_PINOUT pinout) {
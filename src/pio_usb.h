@@ -15,6 +15,7 @@ void pio_usb_host_task(void);
 void pio_usb_host_stop(void);
 void pio_usb_host_restart(void);
 uint32_t pio_usb_host_get_frame_number(void);
+uint16_t pio_usb_host_get_periodic_load_us(void);
 
 // Call this every 1ms when skip_alarm_pool is true.
 void pio_usb_host_frame(void);
@@ -29,6 +30,10 @@ endpoint_t *pio_usb_get_endpoint(usb_device_t *device, uint8_t idx);
 int pio_usb_get_in_data(endpoint_t *ep, uint8_t *buffer, uint8_t len);
 int pio_usb_set_out_data(endpoint_t *ep, const uint8_t *buffer, uint8_t len);
 
+// Packets dropped for bit stuffing error. Counted only when RX PIO has room
+// for the checking decoder, i.e. TX uses the other PIO.
+uint32_t pio_usb_get_bs_err_count(void);
+
 #ifdef __cplusplus
  }
 #endif
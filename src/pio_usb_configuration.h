@@ -19,6 +19,12 @@ typedef struct {
     int8_t debug_pin_eop;
     bool skip_alarm_pool;
     PIO_USB_PINOUT pinout;
+    bool tx_dma_word; // move encoded TX data by 32bit DMA instead of 8bit
+    // rx_dma and rx_word receive a packet into usb_rx_buffer and copy its
+    // payload, only the default byte path writes to the transfer buffer
+    bool rx_dma; // drain RX FIFO by DMA channel rx_ch instead of CPU
+    uint8_t rx_ch; // used if rx_dma, must differ from tx_ch
+    bool rx_word; // read received data packets from RX FIFO by 32bit, CPU read only
 } pio_usb_configuration_t;
 
 #ifndef PIO_USB_DP_PIN_DEFAULT
@@ -28,6 +34,7 @@ typedef struct {
 #define PIO_USB_TX_DEFAULT 0
 #define PIO_SM_USB_TX_DEFAULT 0
 #define PIO_USB_DMA_TX_DEFAULT 0
+#define PIO_USB_DMA_RX_DEFAULT 1
 
 #define PIO_USB_RX_DEFAULT 0
 #define PIO_SM_USB_RX_DEFAULT 1
@@ -35,17 +42,77 @@ typedef struct {
 
 #define PIO_USB_DEBUG_PIN_NONE (-1)
 
+// Host/device response timeout in bit times: 3 bit EOP still on the wire,
+// 18 bit turnaround, then SYNC and PID to be decoded
+#ifndef PIO_USB_RX_TIMEOUT_BITS
+#define PIO_USB_RX_TIMEOUT_BITS (3 + 18 + 16)
+#endif
+
+// Host keeps issuing bulk and control transactions in a frame while they
+// finish within this time from SOF. 0: one transaction per endpoint per frame
+#ifndef PIO_USB_FRAME_BUDGET_US
+#define PIO_USB_FRAME_BUDGET_US 0
+#endif
+
+// Length of the host periodic schedule in frames, a power of two. Interrupt
+// endpoints are polled every bInterval rounded down to a power of two, at
+// most this many frames
+#ifndef PIO_USB_PERIODIC_FRAMES
+#define PIO_USB_PERIODIC_FRAMES 32
+#endif
+
+// Largest host isochronous packet
+#ifndef PIO_USB_ISO_PACKET_MAX
+#define PIO_USB_ISO_PACKET_MAX 1023
+#endif
+
+// Largest host isochronous OUT packet above 64 bytes. One encode buffer of
+// this size is shared by isochronous OUT endpoints. 0: no shared buffer,
+// packets up to 64 bytes are encoded into the endpoint buffer
+#ifndef PIO_USB_ISO_OUT_PACKET_MAX
+#define PIO_USB_ISO_OUT_PACKET_MAX 0
+#endif
+
+// Host completion records kept per root port for the task, 0 (off) or a
+// power of two up to 128. The task must drain them with
+// pio_usb_host_get_completions(), records are dropped and counted when it
+// does not keep up
+#ifndef PIO_USB_COMPLETION_RING_CNT
+#define PIO_USB_COMPLETION_RING_CNT 0
+#endif
+
+// Default NAK policy of host bulk and control endpoints: retries in the same
+// frame after NAK, minimum gap between them, and time from SOF after which
+// no retry starts. 0 retry: try again next frame
+#ifndef PIO_USB_NAK_RETRY_DEFAULT
+#define PIO_USB_NAK_RETRY_DEFAULT 0
+#endif
+#ifndef PIO_USB_NAK_GAP_US_DEFAULT
+#define PIO_USB_NAK_GAP_US_DEFAULT 10
+#endif
+#ifndef PIO_USB_NAK_END_US_DEFAULT
+#define PIO_USB_NAK_END_US_DEFAULT 800
+#endif
+
+// Host retries of an IN transaction in the same frame on bit stuffing error
+#ifndef PIO_USB_RX_BS_ERR_RETRY
+#define PIO_USB_RX_BS_ERR_RETRY 2
+#endif
+
 #define PIO_USB_DEFAULT_CONFIG                                             \
   {                                                                        \
     PIO_USB_DP_PIN_DEFAULT, PIO_USB_TX_DEFAULT, PIO_SM_USB_TX_DEFAULT,     \
         PIO_USB_DMA_TX_DEFAULT, PIO_USB_RX_DEFAULT, PIO_SM_USB_RX_DEFAULT, \
         PIO_SM_USB_EOP_DEFAULT, NULL, PIO_USB_DEBUG_PIN_NONE,              \
-        PIO_USB_DEBUG_PIN_NONE, false, PIO_USB_PINOUT_DPDM                 \
+        PIO_USB_DEBUG_PIN_NONE, false, PIO_USB_PINOUT_DPDM, false,         \
+        false, PIO_USB_DMA_RX_DEFAULT, false                               \
   }
 
 #define PIO_USB_EP_POOL_CNT 32
 #define PIO_USB_DEV_EP_CNT 16
-#define PIO_USB_DEVICE_CNT 4
+#ifndef PIO_USB_DEVICE_CNT
+#define PIO_USB_DEVICE_CNT 8
+#endif
 #define PIO_USB_HUB_PORT_CNT 8
 #define PIO_USB_ROOT_PORT_CNT 2
 
@@ -25,19 +25,12 @@
 
 static uint8_t new_devaddr = 0;
 static uint8_t ep0_crc5_lut[16];
+static uint8_t setup_buffer[8];
 static __unused usb_descriptor_buffers_t descriptor_buffers;
 
-static uint8_t nak_encoded[5];
-static uint8_t stall_encoded[5];
-
 static void __no_inline_not_in_flash_func(update_ep0_crc5_lut)(uint8_t addr) {
-  uint16_t dat;
-  uint8_t crc;
-
   for (int epnum = 0; epnum < 16; epnum++) {
-    dat = (addr) | (epnum << 7);
-    crc = calc_usb_crc5(dat);
-    ep0_crc5_lut[epnum] = (crc << 3) | ((epnum >> 1) & 0x07);
+    ep0_crc5_lut[epnum] = usb_crc5_token_byte((addr) | (epnum << 7));
   }
 }
 
@@ -141,15 +134,24 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
 
     endpoint_t *ep = PIO_USB_ENDPOINT((ep_num << 1) | 0x01);
 
-    pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+    pio_usb_bus_start_tx(pp);
     volatile bool has_transfer = ep->has_transfer;
 
     if (has_transfer) {
-      dma_channel_transfer_from_buffer_now(pp->tx_ch, ep->buffer, ep->encoded_data_len);
+      uint8_t const idx = ep->buffer_idx;
+      dma_channel_transfer_from_buffer_now(
+          pp->tx_ch, ep->encoded_data[idx],
+          ep->encoded_data_len[idx] >> pp->tx_len_shift);
     } else if (ep->stalled) {
-      dma_channel_transfer_from_buffer_now(pp->tx_ch, stall_encoded, sizeof(stall_encoded));
+      dma_channel_transfer_from_buffer_now(
+          pp->tx_ch, pio_usb_const_packet[PIO_USB_PACKET_STALL].encoded,
+          pio_usb_ll_const_packet_len(pp, PIO_USB_PACKET_STALL) >>
+              pp->tx_len_shift);
     } else {
-      dma_channel_transfer_from_buffer_now(pp->tx_ch, nak_encoded, sizeof(nak_encoded));
+      dma_channel_transfer_from_buffer_now(
+          pp->tx_ch, pio_usb_const_packet[PIO_USB_PACKET_NAK].encoded,
+          pio_usb_ll_const_packet_len(pp, PIO_USB_PACKET_NAK) >>
+              pp->tx_len_shift);
     }
 
     pp->pio_usb_tx->irq = IRQ_TX_ALL_MASK; // clear complete flag
@@ -203,7 +205,8 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
     uint8_t hanshake = ep->stalled
                            ? USB_PID_STALL
                            : (ep->has_transfer ? USB_PID_ACK : USB_PID_NAK);
-    int res = pio_usb_bus_receive_packet_and_handshake(pp, hanshake);
+    int res = pio_usb_bus_receive_packet_and_handshake(
+        pp, hanshake, ep->app_buf, ep->total_len - ep->actual_len);
     pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
     restart_usb_receiver(pp);
     pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
@@ -211,7 +214,6 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
 
     if (ep->has_transfer) {
       if (res >= 0) {
-        memcpy(ep->app_buf, pp->usb_rx_buffer + 2, res);
         pio_usb_ll_transfer_continue(ep, res);
       }
     }
@@ -221,18 +223,20 @@ static void __no_inline_not_in_flash_func(usb_device_packet_handler)(void) {
     if (ep_num < 0) {
       return;
     }
-    int res = pio_usb_bus_receive_packet_and_handshake(pp, USB_PID_ACK);
+    int res = pio_usb_bus_receive_packet_and_handshake(
+        pp, USB_PID_ACK, setup_buffer, sizeof(setup_buffer));
     pio_sm_clear_fifos(pp->pio_usb_rx, pp->sm_rx);
     restart_usb_receiver(pp);
     pp->pio_usb_rx->irq = IRQ_RX_ALL_MASK;
     irq_clear(pp->device_rx_irq_num);
 
     if (res >= 0) {
-      rport->setup_packet = pp->usb_rx_buffer + 2;
+      rport->setup_packet = setup_buffer;
       rport->ints |= PIO_USB_INTS_SETUP_REQ_BITS;
 
       // DATA1 for both data and status stage
-      PIO_USB_ENDPOINT(0)->has_transfer = PIO_USB_ENDPOINT(1)->has_transfer = false;
+      pio_usb_ll_transfer_cancel(PIO_USB_ENDPOINT(0));
+      pio_usb_ll_transfer_cancel(PIO_USB_ENDPOINT(1));
       PIO_USB_ENDPOINT(0)->data_id = PIO_USB_ENDPOINT(1)->data_id = 1;
       PIO_USB_ENDPOINT(0)->stalled = PIO_USB_ENDPOINT(1)->stalled = false;
     }
@@ -295,13 +299,6 @@ usb_device_t *pio_usb_device_init(const pio_usb_configuration_t *c,
   irq_set_exclusive_handler(pp->device_rx_irq_num, usb_device_packet_handler);
   irq_set_enabled(pp->device_rx_irq_num, true);
 
-
-  // pre-encode handshake packets
-  uint8_t raw_packet[] = {USB_SYNC, USB_PID_NAK};
-  pio_usb_ll_encode_tx_data(raw_packet, 2, nak_encoded);
-  raw_packet[1] = USB_PID_STALL;
-  pio_usb_ll_encode_tx_data(raw_packet, 2, stall_encoded);
-
   return dev;
 }
 
@@ -550,12 +547,20 @@ static void __no_inline_not_in_flash_func(__pio_usb_device_irq_handler)(uint8_t
   }
 
   if (ints & PIO_USB_INTS_ENDPOINT_CONTINUE_BITS) {
-    for (int b = 0; b < 16; b++) {
-      if (root->ep_continue & (1 << b)) {
-        endpoint_t *ep = PIO_USB_ENDPOINT((b << 1) | 0x01);
-        uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
-        pio_usb_ll_transfer_continue(ep, xact_len);
-        root->ep_continue &= ~(1 << b);
+    // bits set by the receive ISR meanwhile are handled in this loop too
+    uint32_t pending;
+    while ((pending = root->ep_continue) != 0) {
+      uint8_t const b = __builtin_ctz(pending);
+      // clear before handling, the receive ISR may set it again for the
+      // next packet of this endpoint
+      uint32_t const save = save_and_disable_interrupts();
+      root->ep_continue &= ~(1u << b);
+      restore_interrupts(save);
+
+      endpoint_t *ep = PIO_USB_ENDPOINT((b << 1) | 0x01);
+      uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
+      if (pio_usb_ll_transfer_continue(ep, xact_len)) {
+        pio_usb_ll_prepare_next_tx(ep);
       }
     }
   }
@@ -25,15 +25,32 @@ static alarm_pool_t *_alarm_pool = NULL;
 static repeating_timer_t sof_rt;
 // The sof_count may be incremented and then read on different cores.
 static volatile uint32_t sof_count = 0;
+static uint32_t frame_start_us; // timer at the start of current frame
 static bool timer_active;
 
 static volatile bool cancel_timer_flag;
 static volatile bool start_timer_flag;
 static __unused uint32_t int_stat;
-static uint8_t sof_packet[4] = {USB_SYNC, USB_PID_SOF, 0x00, 0x10};
-static uint8_t sof_packet_encoded[4 * 2 * 7 / 6 + 2];
+static uint8_t sof_packet_encoded[4 * 2 * 7 / 6 + 3] __attribute__((aligned(4)));
 static uint8_t sof_packet_encoded_len;
 
+// Bus time of interrupt transactions per frame of the periodic schedule,
+// indexed by frame number modulo PIO_USB_PERIODIC_FRAMES
+static uint16_t periodic_load_us[PIO_USB_PERIODIC_FRAMES];
+#if PIO_USB_FRAME_BUDGET_US
+static uint8_t rr_ep_idx[PIO_USB_ROOT_PORT_CNT]; // last served bulk endpoint
+#endif
+// pio_usb_device[] index + 1 by device address, 0: not opened
+static uint8_t host_dev_id[PIO_USB_ROOT_PORT_CNT][128];
+#if PIO_USB_ISO_OUT_PACKET_MAX > 64
+// isochronous OUT packet is encoded right before it is sent
+static uint8_t iso_encoded[(PIO_USB_ISO_OUT_PACKET_MAX + 4) * 2 * 7 / 6 + 6]
+    __attribute__((aligned(4)));
+#define ISO_OUT_SIZE_MAX PIO_USB_ISO_OUT_PACKET_MAX
+#else
+#define ISO_OUT_SIZE_MAX 64 // fits in endpoint buffer
+#endif
+
 static bool sof_timer(repeating_timer_t *_rt);
 
 //--------------------------------------------------------------------+
@@ -80,8 +97,7 @@ usb_device_t *pio_usb_host_init(const pio_usb_configuration_t *c) {
                                   &pp->clk_div_ls_rx.div_int,
                                   &pp->clk_div_ls_rx.div_frac);
 
-  sof_packet_encoded_len =
-      pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
+  sof_packet_encoded_len = pio_usb_ll_encode_sof(0, sof_packet_encoded);
 
   if (!c->skip_alarm_pool) {
     _alarm_pool = c->alarm_pool;
@@ -161,6 +177,8 @@ static void __no_inline_not_in_flash_func(configure_fullspeed_host)(
   pio_sm_set_jmp_pin(pp->pio_usb_rx, pp->sm_eop, port->pin_dm);
   pio_sm_set_in_pins(pp->pio_usb_rx, pp->sm_eop, port->pin_dp);
   SM_SET_CLKDIV(pp->pio_usb_rx, pp->sm_eop, pp->clk_div_fs_rx);
+
+  pp->rx_timeout_us = PIO_USB_RX_TIMEOUT_FS_US;
 }
 
 static void __no_inline_not_in_flash_func(configure_lowspeed_host)(
@@ -178,6 +196,8 @@ static void __no_inline_not_in_flash_func(configure_lowspeed_host)(
   pio_sm_set_jmp_pin(pp->pio_usb_rx, pp->sm_eop, port->pin_dp);
   pio_sm_set_in_pins(pp->pio_usb_rx, pp->sm_eop, port->pin_dm);
   SM_SET_CLKDIV(pp->pio_usb_rx, pp->sm_eop, pp->clk_div_ls_rx);
+
+  pp->rx_timeout_us = PIO_USB_RX_TIMEOUT_LS_US;
 }
 
 static void __no_inline_not_in_flash_func(configure_root_port)(
@@ -189,7 +209,7 @@ static void __no_inline_not_in_flash_func(configure_root_port)(
   }
 }
 
-static void __no_inline_not_in_flash_func(restore_fs_bus)(const pio_port_t *pp) {
+static void __no_inline_not_in_flash_func(restore_fs_bus)(pio_port_t *pp) {
   // change bus speed to full-speed
   pio_sm_set_enabled(pp->pio_usb_tx, pp->sm_tx, false);
   SM_SET_CLKDIV(pp->pio_usb_tx, pp->sm_tx, pp->clk_div_fs_tx);
@@ -202,6 +222,8 @@ static void __no_inline_not_in_flash_func(restore_fs_bus)(const pio_port_t *pp)
   pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_eop, false);
   SM_SET_CLKDIV(pp->pio_usb_rx, pp->sm_eop, pp->clk_div_fs_rx);
   pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_eop, true);
+
+  pp->rx_timeout_us = PIO_USB_RX_TIMEOUT_FS_US;
 }
 
 // Time about 1us ourselves so it lives in RAM.
@@ -224,10 +246,10 @@ static bool __no_inline_not_in_flash_func(connection_check)(root_port_t *port) {
       port->ints |= PIO_USB_INTS_DISCONNECT_BITS;
 
       // failed/retired all queuing transfer in this root
-      uint8_t root_idx = port - PIO_USB_ROOT_PORT(0);
-      for (int ep_idx = 0; ep_idx < PIO_USB_EP_POOL_CNT; ep_idx++) {
-        endpoint_t *ep = PIO_USB_ENDPOINT(ep_idx);
-        if ((ep->root_idx == root_idx) && ep->size && ep->has_transfer) {
+      uint32_t active = port->ep_active;
+      while (active) {
+        endpoint_t *ep = PIO_USB_ENDPOINT(pio_usb_ll_pop_ep(&active));
+        if (ep->has_transfer) {
           pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_ERROR_BITS);
         }
       }
@@ -245,6 +267,91 @@ static bool __no_inline_not_in_flash_func(connection_check)(root_port_t *port) {
 static int usb_setup_transaction(pio_port_t *pp, endpoint_t *ep);
 static int usb_in_transaction(pio_port_t *pp, endpoint_t *ep);
 static int usb_out_transaction(pio_port_t *pp, endpoint_t *ep);
+static void usb_iso_transaction(pio_port_t *pp, endpoint_t *ep);
+
+// Whether NAKed ep may be polled again in this frame after retry retries
+static bool __no_inline_not_in_flash_func(nak_retry)(endpoint_t *ep,
+                                                     uint8_t retry) {
+  pio_usb_nak_policy_t const *policy = &ep->nak_policy;
+  uint8_t const type = ep->attr & 0x03;
+
+  if (retry >= policy->retry ||
+      (type != EP_ATTR_BULK && type != EP_ATTR_CONTROL)) {
+    return false;
+  }
+
+  uint32_t const nak_at = timer_hw->timerawl;
+  bool const fullspeed =
+      PIO_USB_ROOT_PORT(ep->root_idx)->is_fullspeed && !ep->need_pre;
+  uint32_t const xact_end = nak_at + policy->gap_us - frame_start_us +
+                            pio_usb_ll_transaction_time_us(ep, fullspeed);
+  if (xact_end > policy->end_us) {
+    return false;
+  }
+
+  while (timer_hw->timerawl - nak_at < policy->gap_us) {
+    continue;
+  }
+
+  return true;
+}
+
+static void __no_inline_not_in_flash_func(endpoint_transaction)(
+    pio_port_t *pp, endpoint_t *ep) {
+  ep->transfer_started = true;
+
+  if (ep->need_pre) {
+    // PRE switches bus to low-speed for this transaction
+    pp->need_pre = true;
+    pp->rx_timeout_us = PIO_USB_RX_TIMEOUT_LS_US;
+  }
+
+  if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
+    usb_setup_transaction(pp, ep);
+  } else {
+    uint8_t retry = 0;
+    while (true) {
+      int const res = (ep->ep_num & EP_IN) ? usb_in_transaction(pp, ep)
+                                           : usb_out_transaction(pp, ep);
+      if (res != PIO_USB_XACT_NAK) {
+        break;
+      }
+      ep->nak_cnt++;
+      if (!nak_retry(ep, retry++)) {
+        ep->nak_defer_cnt++;
+        break;
+      }
+    }
+  }
+
+  if (ep->need_pre) {
+    pp->need_pre = false;
+    restore_fs_bus(pp);
+  }
+
+  ep->transfer_started = false;
+}
+
+#if PIO_USB_FRAME_BUDGET_US
+static uint32_t __not_in_flash_func(frame_elapsed_us)(void *ctx) {
+  (void)ctx;
+  return timer_hw->timerawl - frame_start_us;
+}
+
+static void __not_in_flash_func(budget_transaction)(void *ctx,
+                                                     endpoint_t *ep) {
+  endpoint_transaction((pio_port_t *)ctx, ep);
+}
+
+// Bulk and control endpoints of root until the frame budget is used
+static void __no_inline_not_in_flash_func(endpoint_transaction_budget)(
+    pio_port_t *pp, root_port_t *root, uint8_t root_idx) {
+  pio_usb_ll_budget_round_robin(pio_usb_ep_pool, &root->ep_active,
+                                &rr_ep_idx[root_idx], root->is_fullspeed,
+                                PIO_USB_FRAME_BUDGET_US, frame_elapsed_us,
+                                budget_transaction, pp);
+}
+#endif
 
 void __not_in_flash_func(pio_usb_host_frame)(void) {
   if (!timer_active) {
@@ -252,6 +359,7 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
   }
 
   pio_port_t *pp = PIO_USB_PIO_PORT(0);
+  frame_start_us = timer_hw->timerawl;
 
   // Send SOF
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
@@ -264,58 +372,65 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
     pio_usb_bus_usb_transfer(pp, sof_packet_encoded, sof_packet_encoded_len);
   }
 
-  // Carry out all queued endpoint transaction
+  // Isochronous streams first, at fixed time after SOF
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
     root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
-    if (!(root->initialized && root->connected && !root->suspended)) {
+    uint32_t iso = root->ep_active & root->ep_iso;
+    if (!(root->initialized && root->connected && !root->suspended && iso)) {
       continue;
     }
 
     configure_root_port(pp, root);
 
-    for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT;
-         ep_pool_idx++) {
-      endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
-      if ((ep->root_idx == root_idx) && ep->size) {
-        bool const is_periodic = ((ep->attr & 0x03) == EP_ATTR_INTERRUPT);
+    while (iso) {
+      endpoint_t *ep = PIO_USB_ENDPOINT(pio_usb_ll_pop_ep(&iso));
 
-        if (is_periodic && (ep->interval_counter > 0)) {
-          ep->interval_counter--;
-          continue;
-        }
+      if ((sof_count & (ep->interval - 1)) == ep->interval_phase) {
+        usb_iso_transaction(pp, ep);
+      }
+    }
+  }
 
-        if (ep->has_transfer && !ep->transfer_aborted) {
-          ep->transfer_started = true;
+  // Carry out all queued endpoint transaction
+  for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
+    root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+    if (!(root->initialized && root->connected && !root->suspended)) {
+      continue;
+    }
 
-          if (ep->need_pre) {
-            pp->need_pre = true;
-          }
+    configure_root_port(pp, root);
 
-          if (ep->ep_num == 0 && ep->data_id == USB_PID_SETUP) {
-            usb_setup_transaction(pp, ep);
-          } else {
-            if (ep->ep_num & EP_IN) {
-              usb_in_transaction(pp, ep);
-            } else {
-              usb_out_transaction(pp, ep);
-            }
+    // only endpoints with pending transfer, in pool order
+    uint32_t active = root->ep_active & ~root->ep_iso;
+    while (active) {
+      endpoint_t *ep = PIO_USB_ENDPOINT(pio_usb_ll_pop_ep(&active));
 
-            if (is_periodic) {
-              ep->interval_counter = ep->interval - 1;
-            }
-          }
+      bool const is_periodic = ((ep->attr & 0x03) == EP_ATTR_INTERRUPT);
 
-          if (ep->need_pre) {
-            pp->need_pre = false;
-            restore_fs_bus(pp);
-          }
+      if (is_periodic &&
+          (sof_count & (ep->interval - 1)) != ep->interval_phase) {
+        continue;
+      }
 
-          ep->transfer_started = false;
-        }
+      if (ep->has_transfer && !ep->transfer_aborted) {
+        endpoint_transaction(pp, ep);
       }
     }
   }
 
+#if PIO_USB_FRAME_BUDGET_US
+  // Remaining frame time goes to bulk and control transfers
+  for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
+    root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+    if (!(root->initialized && root->connected && !root->suspended)) {
+      continue;
+    }
+
+    configure_root_port(pp, root);
+    endpoint_transaction_budget(pp, root, root_idx);
+  }
+#endif
+
   // check for new connection to root hub
   for (int root_idx = 0; root_idx < PIO_USB_ROOT_PORT_CNT; root_idx++) {
     root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
@@ -340,11 +455,8 @@ void __not_in_flash_func(pio_usb_host_frame)(void) {
   sof_count++;
 
   // SOF counter is 11-bit
-  uint16_t const sof_count_11b = sof_count & 0x7ff;
-  sof_packet[2] = sof_count_11b & 0xff;
-  sof_packet[3] = (calc_usb_crc5(sof_count_11b) << 3) | (sof_count_11b >> 8);
   sof_packet_encoded_len =
-      pio_usb_ll_encode_tx_data(sof_packet, sizeof(sof_packet), sof_packet_encoded);
+      pio_usb_ll_encode_sof(sof_count & 0x7ff, sof_packet_encoded);
 }
 
 static bool __no_inline_not_in_flash_func(sof_timer)(repeating_timer_t *_rt) {
@@ -363,6 +475,23 @@ uint32_t pio_usb_host_get_frame_number(void) {
   return sof_count;
 }
 
+#if PIO_USB_COMPLETION_RING_CNT
+// Take up to max completion records of root in the order they happened
+uint8_t pio_usb_host_get_completions(uint8_t root_idx,
+                                     pio_usb_completion_t *recs, uint8_t max) {
+  return pio_usb_ll_completion_pop(PIO_USB_ROOT_PORT(root_idx), recs, max);
+}
+#endif
+
+// Worst case bus time of interrupt transactions in a frame
+uint16_t pio_usb_host_get_periodic_load_us(void) {
+  uint16_t peak = 0;
+  for (int frame = 0; frame < PIO_USB_PERIODIC_FRAMES; frame++) {
+    peak = periodic_load_us[frame] > peak ? periodic_load_us[frame] : peak;
+  }
+  return peak;
+}
+
 void pio_usb_host_port_reset_start(uint8_t root_idx) {
   root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
 
@@ -390,45 +519,184 @@ void pio_usb_host_port_reset_end(uint8_t root_idx) {
   root->suspended = false;
 }
 
+// Add (or remove) bus time of ep to the frames of its phase
+static void periodic_reserve(endpoint_t *ep, bool reserve) {
+  for (int frame = ep->interval_phase; frame < PIO_USB_PERIODIC_FRAMES;
+       frame += ep->interval) {
+    if (reserve) {
+      periodic_load_us[frame] += ep->periodic_us;
+    } else {
+      periodic_load_us[frame] -= ep->periodic_us;
+    }
+  }
+}
+
+static inline __force_inline usb_device_t *_find_device(
+    uint8_t root_idx, uint8_t device_address) {
+  uint8_t const dev_id = host_dev_id[root_idx][device_address & 0x7f];
+  return dev_id ? &pio_usb_device[dev_id - 1] : NULL;
+}
+
+// Free pool entry ep_id - 1 together with its periodic time and iso stream
+static void release_endpoint(uint8_t root_idx, uint8_t ep_id) {
+  endpoint_t *ep = PIO_USB_ENDPOINT(ep_id - 1);
+
+  pio_usb_ll_transfer_cancel(ep);
+  if (ep->periodic_us) {
+    periodic_reserve(ep, false);
+    ep->periodic_us = 0;
+  }
+  PIO_USB_ROOT_PORT(root_idx)->ep_iso &= ~(1u << (ep_id - 1));
+  if (ep->iso_ring) {
+    // inactive now, but frame ISR may still be in its transaction
+    while (ep->transfer_started) {
+      busy_wait_us(10);
+    }
+    ep->iso_ring = NULL;
+  }
+  ep->device = NULL;
+  ep->size = 0;
+}
+
 void pio_usb_host_close_device(uint8_t root_idx, uint8_t device_address) {
-  for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
-    endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
-    if ((ep->root_idx == root_idx) && (ep->dev_addr == device_address) &&
-        ep->size) {
-      ep->size = 0;
-      ep->has_transfer = false;
+  usb_device_t *device = _find_device(root_idx, device_address);
+  if (!device) {
+    return;
+  }
+
+  for (int slot = 0; slot < 32; slot++) {
+    uint8_t const ep_id = device->host_ep_id[slot];
+    if (ep_id == 0) {
+      continue;
+    }
+    if (PIO_USB_ENDPOINT(ep_id - 1)->size == 0) {
+      continue; // control endpoint is in both slots 0 and 1
     }
+    release_endpoint(root_idx, ep_id);
   }
+
+  memset(device->host_ep_id, 0, sizeof(device->host_ep_id));
+  device->root = NULL;
+  host_dev_id[root_idx][device_address & 0x7f] = 0;
 }
 
 static inline __force_inline endpoint_t * _find_ep(uint8_t root_idx, 
                                                    uint8_t device_address, uint8_t ep_address) {
-  for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
-    endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
-    // note 0x00 and 0x80 are matched as control endpoint of opposite direction
-    if ((ep->root_idx == root_idx) && (ep->dev_addr == device_address) &&
-        ep->size &&
-        ((ep->ep_num == ep_address) ||
-         (((ep_address & 0x7f) == 0) && ((ep->ep_num & 0x7f) == 0)))) {
-      return ep;
+  usb_device_t *device = _find_device(root_idx, device_address);
+  if (!device) {
+    return NULL;
+  }
+
+  // note 0x00 and 0x80 are the same control endpoint of opposite direction
+  uint8_t const ep_id = device->host_ep_id[PIO_USB_EP_ADDR_IDX(ep_address)];
+  return ep_id ? PIO_USB_ENDPOINT(ep_id - 1) : NULL;
+}
+
+// Device record of address, a free one is taken on first endpoint
+static usb_device_t *open_device(uint8_t root_idx, uint8_t device_address) {
+  usb_device_t *device = _find_device(root_idx, device_address);
+  if (device) {
+    return device;
+  }
+
+  for (int idx = 0; idx < PIO_USB_DEVICE_CNT; idx++) {
+    device = &pio_usb_device[idx];
+    if (device->root == NULL) {
+      memset(device->host_ep_id, 0, sizeof(device->host_ep_id));
+      device->root = PIO_USB_ROOT_PORT(root_idx);
+      device->address = device_address;
+      host_dev_id[root_idx][device_address & 0x7f] = idx + 1;
+      return device;
     }
   }
 
   return NULL;
 }
 
+// Encode token packet for this endpoint unless it is already cached.
+// Address is fixed while opened, so PID is enough to check validity.
+static inline __force_inline void update_ep_token(endpoint_t *ep,
+                                                  uint8_t token) {
+  if (ep->token_pid != token) {
+    ep->token_encoded_len = pio_usb_ll_encode_token(
+        token, ep->dev_addr, ep->ep_num, ep->token_encoded);
+    ep->token_pid = token;
+  }
+}
+
+static inline __force_inline uint8_t ep_data_token(endpoint_t *ep) {
+  return (ep->ep_num & EP_IN) ? USB_PID_IN : USB_PID_OUT;
+}
+
 bool pio_usb_host_endpoint_open(uint8_t root_idx, uint8_t device_address,
                                 uint8_t const *desc_endpoint, bool need_pre) {
   const endpoint_descriptor_t *d = (const endpoint_descriptor_t *)desc_endpoint;
+
+  // opened again by SET_CONFIGURATION or SET_INTERFACE, free the former entry
+  usb_device_t *opened = _find_device(root_idx, device_address);
+  uint8_t const slot = PIO_USB_EP_ADDR_IDX(d->epaddr);
+  if (opened && opened->host_ep_id[slot]) {
+    release_endpoint(root_idx, opened->host_ep_id[slot]);
+    opened->host_ep_id[slot] = 0;
+    if ((d->epaddr & 0x7f) == 0) {
+      opened->host_ep_id[PIO_USB_EP_ADDR_IDX(d->epaddr ^ EP_IN)] = 0;
+    }
+  }
+
   for (int ep_pool_idx = 0; ep_pool_idx < PIO_USB_EP_POOL_CNT; ep_pool_idx++) {
     endpoint_t *ep = PIO_USB_ENDPOINT(ep_pool_idx);
     // ep size is used as valid indicator
     if (ep->size == 0) {
+      usb_device_t *device = open_device(root_idx, device_address);
+      if (!device) {
+        return false;
+      }
+
       pio_usb_ll_configure_endpoint(ep, desc_endpoint);
       ep->root_idx = root_idx;
       ep->dev_addr = device_address;
       ep->need_pre = need_pre;
       ep->is_tx = (d->epaddr & 0x80) ? false : true; // host endpoint out is tx
+      ep->token_pid = 0;
+      update_ep_token(ep, ep_data_token(ep));
+      ep->nak_policy = (pio_usb_nak_policy_t){PIO_USB_NAK_RETRY_DEFAULT,
+                                              PIO_USB_NAK_GAP_US_DEFAULT,
+                                              PIO_USB_NAK_END_US_DEFAULT};
+      ep->nak_cnt = 0;
+      ep->nak_defer_cnt = 0;
+
+      ep->periodic_us = 0;
+      ep->iso_ring = NULL;
+      uint8_t const type = ep->attr & 0x03;
+      root_port_t *root = PIO_USB_ROOT_PORT(root_idx);
+      if (type == EP_ATTR_ISOCHRONOUS) {
+        if (ep->size > PIO_USB_ISO_PACKET_MAX ||
+            (ep->is_tx && ep->size > ISO_OUT_SIZE_MAX) ||
+            !root->is_fullspeed || need_pre) {
+          ep->size = 0;
+          return false;
+        }
+        // bInterval is 2^(bInterval-1) frames
+        uint8_t const exp = d->interval ? d->interval - 1 : 0;
+        ep->interval = exp < 8 ? 1u << exp : 0xff;
+        root->ep_iso |= 1u << ep_pool_idx;
+      }
+      if (type == EP_ATTR_INTERRUPT || type == EP_ATTR_ISOCHRONOUS) {
+        // spread endpoints over the frames to keep SOF interrupt short
+        ep->interval = pio_usb_ll_periodic_period(ep->interval);
+        ep->interval_phase =
+            pio_usb_ll_periodic_phase(periodic_load_us, ep->interval);
+        ep->periodic_us =
+            pio_usb_ll_transaction_time_us(ep, root->is_fullspeed && !need_pre);
+        periodic_reserve(ep, true);
+      }
+
+      ep->device = device;
+      device->host_ep_id[slot] = ep_pool_idx + 1;
+      if ((d->epaddr & 0x7f) == 0) {
+        device->host_ep_id[PIO_USB_EP_ADDR_IDX(d->epaddr ^ EP_IN)] =
+            ep_pool_idx + 1;
+      }
       return true;
     }
   }
@@ -447,6 +715,7 @@ bool pio_usb_host_send_setup(uint8_t root_idx, uint8_t device_address,
   ep->ep_num = 0; // setup is is OUT
   ep->data_id = USB_PID_SETUP;
   ep->is_tx = true;
+  update_ep_token(ep, USB_PID_SETUP);
 
   return pio_usb_ll_transfer_start(ep, (uint8_t *)setup_packet, 8);
 }
@@ -466,11 +735,61 @@ bool pio_usb_host_endpoint_transfer(uint8_t root_idx, uint8_t device_address,
     ep->ep_num = ep_address;
     ep->is_tx = ep_address == 0;
     ep->data_id = 1; // data and status always start with DATA1
+    update_ep_token(ep, ep_data_token(ep));
   }
 
   return pio_usb_ll_transfer_start(ep, buffer, buflen);
 }
 
+// Queue desc on a bulk or interrupt endpoint, it is transferred after the
+// descriptors queued before without a frame in between.
+bool pio_usb_host_endpoint_enqueue(uint8_t root_idx, uint8_t device_address,
+                                   uint8_t ep_address,
+                                   pio_usb_xfer_desc_t *desc) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep) {
+    printf("no endpoint 0x%02X\r\n", ep_address);
+    return false;
+  }
+
+  uint8_t const type = ep->attr & 0x03;
+  if (type != EP_ATTR_BULK && type != EP_ATTR_INTERRUPT) {
+    return false;
+  }
+
+  return pio_usb_ll_transfer_enqueue(ep, desc);
+}
+
+bool pio_usb_host_endpoint_set_nak_policy(uint8_t root_idx,
+                                           uint8_t device_address,
+                                           uint8_t ep_address,
+                                           pio_usb_nak_policy_t const *policy) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep) {
+    printf("no endpoint 0x%02X\r\n", ep_address);
+    return false;
+  }
+
+  ep->nak_policy = *policy;
+
+  return true;
+}
+
+bool pio_usb_host_endpoint_get_nak_count(uint8_t root_idx,
+                                         uint8_t device_address,
+                                         uint8_t ep_address, uint32_t *nak,
+                                         uint32_t *deferred) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep) {
+    return false;
+  }
+
+  *nak = ep->nak_cnt;
+  *deferred = ep->nak_defer_cnt;
+
+  return true;
+}
+
 bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_address,
                                           uint8_t ep_address) {
   endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
@@ -496,38 +815,156 @@ bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_addre
   // check if transfer is still active (could be completed)
   bool const still_active = ep->has_transfer;
   if (still_active) {
-    ep->has_transfer = false;
+    pio_usb_ll_transfer_cancel(ep);
   }
   ep->transfer_aborted = false;
 
   return still_active; // still active means transfer is successfully aborted
 }
 
+// Stream packets of an isochronous endpoint through ring, one per polling
+// period, until pio_usb_host_endpoint_iso_stop()
+bool pio_usb_host_endpoint_iso_start(uint8_t root_idx, uint8_t device_address,
+                                     uint8_t ep_address,
+                                     pio_usb_iso_ring_t *ring) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep) {
+    printf("no endpoint 0x%02X\r\n", ep_address);
+    return false;
+  }
+
+  if ((ep->attr & 0x03) != EP_ATTR_ISOCHRONOUS || ep->has_transfer ||
+      ring->slot_cnt == 0 || ring->slot_cnt > 128 ||
+      (ring->slot_cnt & (ring->slot_cnt - 1)) ||
+      (!ep->is_tx && ring->slot_size < ep->size)) {
+    return false;
+  }
+
+  ep->iso_ring = ring;
+  pio_usb_ll_transfer_stream(ep);
+
+  return true;
+}
+
+bool pio_usb_host_endpoint_iso_stop(uint8_t root_idx, uint8_t device_address,
+                                    uint8_t ep_address) {
+  endpoint_t *ep = _find_ep(root_idx, device_address, ep_address);
+  if (!ep || !ep->iso_ring) {
+    return false;
+  }
+
+  pio_usb_ll_transfer_cancel(ep);
+
+  // frame ISR may be in the middle of a transaction on the other core
+  while (ep->transfer_started) {
+    busy_wait_us(10);
+  }
+  ep->iso_ring = NULL;
+
+  return true;
+}
+
 //--------------------------------------------------------------------+
 // Transaction helper
 //--------------------------------------------------------------------+
 
+// One packet from or to the ring, no handshake and no retry
+static void __no_inline_not_in_flash_func(usb_iso_transaction)(pio_port_t *pp,
+                                                               endpoint_t *ep) {
+  // set before ring is read, iso stop waits for it after cancelling
+  ep->transfer_started = true;
+
+  // ep may be stopped or closed on the other core since the frame began
+  pio_usb_iso_ring_t *ring = ep->iso_ring;
+  if (ring == NULL || !ep->has_transfer) {
+    ep->transfer_started = false;
+    return;
+  }
+  uint8_t const mask = ring->slot_cnt - 1;
+
+  if (ep->is_tx) {
+    if (ring->rd == ring->wr) {
+      ring->miss_cnt++;
+    } else {
+      uint8_t const slot = ring->rd & mask;
+      uint16_t const len =
+          ring->len[slot] < ep->size ? ring->len[slot] : ep->size;
+#if PIO_USB_ISO_OUT_PACKET_MAX > 64
+      uint8_t *encoded = iso_encoded;
+#else
+      uint8_t *encoded = ep->buffer;
+#endif
+      uint16_t const encoded_len = pio_usb_ll_encode_tx_packet(
+          USB_PID_DATA0, ring->buf + slot * ring->slot_size, len, encoded);
+
+      update_ep_token(ep, USB_PID_OUT);
+      pio_usb_bus_usb_transfer(pp, ep->token_encoded, ep->token_encoded_len);
+      pio_usb_bus_usb_transfer(pp, encoded, encoded_len);
+      ring->rd++;
+    }
+  } else {
+    if ((uint8_t)(ring->wr - ring->rd) == ring->slot_cnt) {
+      ring->miss_cnt++;
+    } else {
+      uint8_t const slot = ring->wr & mask;
+
+      update_ep_token(ep, USB_PID_IN);
+      pio_usb_bus_prepare_receive(pp);
+      pio_usb_bus_usb_transfer(pp, ep->token_encoded, ep->token_encoded_len);
+      pio_usb_bus_start_receive(pp);
+
+      int const len = pio_usb_bus_receive_packet_and_handshake(
+          pp, PIO_USB_NO_HANDSHAKE, ring->buf + slot * ring->slot_size,
+          ring->slot_size);
+      uint8_t const pid = pp->usb_rx_buffer[1];
+      pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
+
+      if (len >= 0 && (pid == USB_PID_DATA0 || pid == USB_PID_DATA1)) {
+        ring->len[slot] = len < ring->slot_size ? len : ring->slot_size;
+        __compiler_memory_barrier();
+        ring->wr++;
+      } else {
+        ring->err_cnt++;
+      }
+
+      pp->usb_rx_buffer[0] = 0;
+      pp->usb_rx_buffer[1] = 0;
+    }
+  }
+
+  ep->transfer_started = false;
+}
+
 static int __no_inline_not_in_flash_func(usb_in_transaction)(pio_port_t *pp,
                                                              endpoint_t *ep) {
   int res = 0;
   uint8_t expect_pid = (ep->data_id == 1) ? USB_PID_DATA1 : USB_PID_DATA0;
 
-  pio_usb_bus_prepare_receive(pp);
-  pio_usb_bus_send_token(pp, USB_PID_IN, ep->dev_addr, ep->ep_num);
-  pio_usb_bus_start_receive(pp);
-
-  int receive_len = pio_usb_bus_receive_packet_and_handshake(pp, USB_PID_ACK);
+  update_ep_token(ep, USB_PID_IN);
+
+  int receive_len;
+  uint8_t retry = 0;
+  do {
+    pio_usb_bus_prepare_receive(pp);
+    pio_usb_bus_usb_transfer(pp, ep->token_encoded, ep->token_encoded_len);
+    pio_usb_bus_start_receive(pp);
+
+    // data is received into app_buf, it is not counted unless PID matches
+    receive_len = pio_usb_bus_receive_packet_and_handshake(
+        pp, USB_PID_ACK, ep->app_buf, ep->total_len - ep->actual_len);
+    // broken packet is not ACKed, device sends the same data again
+  } while (receive_len == PIO_USB_RX_ERR_BS &&
+           retry++ < PIO_USB_RX_BS_ERR_RETRY);
   uint8_t const receive_pid = pp->usb_rx_buffer[1];
 
   if (receive_len >= 0) {
     if (receive_pid == expect_pid) {
-      memcpy(ep->app_buf, &pp->usb_rx_buffer[2], receive_len);
       pio_usb_ll_transfer_continue(ep, receive_len);
     } else {
       // DATA0/1 mismatched, 0 for re-try next frame
     }
   } else if (receive_pid == USB_PID_NAK) {
-    // NAK try again next frame
+    res = PIO_USB_XACT_NAK;
   } else if (receive_pid == USB_PID_STALL) {
     pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_STALLED_BITS);
   } else {
@@ -551,12 +988,17 @@ static int __no_inline_not_in_flash_func(usb_out_transaction)(pio_port_t *pp,
 
   uint16_t const xact_len = pio_usb_ll_get_transaction_len(ep);
 
+  update_ep_token(ep, USB_PID_OUT);
   pio_usb_bus_prepare_receive(pp);
-  pio_usb_bus_send_token(pp, USB_PID_OUT, ep->dev_addr, ep->ep_num);
+  pio_usb_bus_usb_transfer(pp, ep->token_encoded, ep->token_encoded_len);
 
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_usb_transfer(pp, ep->encoded_data[ep->buffer_idx],
+                           ep->encoded_data_len[ep->buffer_idx]);
   pio_usb_bus_start_receive(pp);
 
+  // handshake is kept in RX FIFO, encode next packet while waiting for it
+  pio_usb_ll_prepare_next_tx(ep);
+
   pio_usb_bus_wait_handshake(pp);
   pio_sm_set_enabled(pp->pio_usb_rx, pp->sm_rx, false);
 
@@ -565,7 +1007,7 @@ static int __no_inline_not_in_flash_func(usb_out_transaction)(pio_port_t *pp,
   if (receive_token == USB_PID_ACK) {
     pio_usb_ll_transfer_continue(ep, xact_len);
   } else if (receive_token == USB_PID_NAK) {
-    // NAK try again next frame
+    res = PIO_USB_XACT_NAK;
   } else if (receive_token == USB_PID_STALL) {
     pio_usb_ll_transfer_complete(ep, PIO_USB_INTS_ENDPOINT_STALLED_BITS);
   } else {
@@ -585,13 +1027,15 @@ static int __no_inline_not_in_flash_func(usb_setup_transaction)(
   int res = 0;
 
   // Setup token
+  update_ep_token(ep, USB_PID_SETUP);
   pio_usb_bus_prepare_receive(pp);
 
-  pio_usb_bus_send_token(pp, USB_PID_SETUP, ep->dev_addr, 0);
+  pio_usb_bus_usb_transfer(pp, ep->token_encoded, ep->token_encoded_len);
 
   // Data
   ep->data_id = 0; // set to DATA0
-  pio_usb_bus_usb_transfer(pp, ep->buffer, ep->encoded_data_len);
+  pio_usb_bus_usb_transfer(pp, ep->encoded_data[ep->buffer_idx],
+                           ep->encoded_data_len[ep->buffer_idx]);
 
   // Handshake
   pio_usb_bus_start_receive(pp);
@@ -617,73 +1061,63 @@ static void __no_inline_not_in_flash_func(handle_endpoint_irq)(
     root_port_t *root, uint32_t flag, volatile uint32_t *ep_reg) {
   (void)root;
   const uint32_t ep_all = *ep_reg;
-
-  for (uint8_t ep_idx = 0; ep_idx < PIO_USB_EP_POOL_CNT; ep_idx++) {
-    if (ep_all & (1u << ep_idx)) {
-      endpoint_t *ep = PIO_USB_ENDPOINT(ep_idx);
-      usb_device_t *device = NULL;
-
-      // find device this endpoint belongs to
-      for (int idx = 0; idx < PIO_USB_DEVICE_CNT; idx++) {
-        usb_device_t *dev = &pio_usb_device[idx];
-        if (dev->connected && (ep->dev_addr == dev->address)) {
-          device = dev;
-          break;
-        }
-      }
-
-      if (device) {
-        // control endpoint is either 0x00 or 0x80
-        if ((ep->ep_num & 0x7f) == 0) {
-          control_pipe_t *pipe = &device->control_pipe;
-
-          if (flag != PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
-            pipe->stage = STAGE_SETUP;
-            pipe->operation = CONTROL_ERROR;
-          } else {
-            ep->data_id = 1; // both data and status have DATA1
-            if (pipe->stage == STAGE_SETUP) {
-              if (pipe->operation == CONTROL_IN) {
-                pipe->stage = STAGE_IN;
+  uint32_t pending = ep_all;
+
+  while (pending) {
+    endpoint_t *ep = PIO_USB_ENDPOINT(pio_usb_ll_pop_ep(&pending));
+    usb_device_t *device = ep->device;
+
+    if (device && device->connected) {
+      // control endpoint is either 0x00 or 0x80
+      if ((ep->ep_num & 0x7f) == 0) {
+        control_pipe_t *pipe = &device->control_pipe;
+
+        if (flag != PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
+          pipe->stage = STAGE_SETUP;
+          pipe->operation = CONTROL_ERROR;
+        } else {
+          ep->data_id = 1; // both data and status have DATA1
+          if (pipe->stage == STAGE_SETUP) {
+            if (pipe->operation == CONTROL_IN) {
+              pipe->stage = STAGE_IN;
+              ep->ep_num = 0x80;
+              ep->is_tx = false;
+              pio_usb_ll_transfer_start(ep,
+                                        (uint8_t *)(uintptr_t)pipe->rx_buffer,
+                                        pipe->request_length);
+            } else if (pipe->operation == CONTROL_OUT) {
+              if (pipe->out_data_packet.tx_address != NULL) {
+                pipe->stage = STAGE_OUT;
+                ep->ep_num = 0x00;
+                ep->is_tx = true;
+                pio_usb_ll_transfer_start(ep,
+                                          pipe->out_data_packet.tx_address,
+                                          pipe->out_data_packet.tx_length);
+              } else {
+                pipe->stage = STAGE_STATUS;
                 ep->ep_num = 0x80;
                 ep->is_tx = false;
-                pio_usb_ll_transfer_start(ep,
-                                          (uint8_t *)(uintptr_t)pipe->rx_buffer,
-                                          pipe->request_length);
-              } else if (pipe->operation == CONTROL_OUT) {
-                if (pipe->out_data_packet.tx_address != NULL) {
-                  pipe->stage = STAGE_OUT;
-                  ep->ep_num = 0x00;
-                  ep->is_tx = true;
-                  pio_usb_ll_transfer_start(ep,
-                                            pipe->out_data_packet.tx_address,
-                                            pipe->out_data_packet.tx_length);
-                } else {
-                  pipe->stage = STAGE_STATUS;
-                  ep->ep_num = 0x80;
-                  ep->is_tx = false;
-                  pio_usb_ll_transfer_start(ep, NULL, 0);
-                }
+                pio_usb_ll_transfer_start(ep, NULL, 0);
               }
-            } else if (pipe->stage == STAGE_IN) {
-              pipe->stage = STAGE_STATUS;
-              ep->ep_num = 0x00;
-              ep->is_tx = true;
-              pio_usb_ll_transfer_start(ep, NULL, 0);
-            } else if (pipe->stage == STAGE_OUT) {
-              pipe->stage = STAGE_STATUS;
-              ep->ep_num = 0x80;
-              ep->is_tx = false;
-              pio_usb_ll_transfer_start(ep, NULL, 0);
-            } else if (pipe->stage == STAGE_STATUS) {
-              pipe->stage = STAGE_SETUP;
-              pipe->operation = CONTROL_COMPLETE;
             }
+          } else if (pipe->stage == STAGE_IN) {
+            pipe->stage = STAGE_STATUS;
+            ep->ep_num = 0x00;
+            ep->is_tx = true;
+            pio_usb_ll_transfer_start(ep, NULL, 0);
+          } else if (pipe->stage == STAGE_OUT) {
+            pipe->stage = STAGE_STATUS;
+            ep->ep_num = 0x80;
+            ep->is_tx = false;
+            pio_usb_ll_transfer_start(ep, NULL, 0);
+          } else if (pipe->stage == STAGE_STATUS) {
+            pipe->stage = STAGE_SETUP;
+            pipe->operation = CONTROL_COMPLETE;
           }
-        } else if (device->device_class == CLASS_HUB && (ep->ep_num & EP_IN)) {
-          // hub interrupt endpoint
-          device->event = EVENT_HUB_PORT_CHANGE;
         }
+      } else if (device->device_class == CLASS_HUB && (ep->ep_num & EP_IN)) {
+        // hub interrupt endpoint
+        device->event = EVENT_HUB_PORT_CHANGE;
       }
     }
   }
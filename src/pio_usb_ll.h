@@ -6,8 +6,10 @@
 #pragma once
 
 #include "hardware/pio.h"
+#include "hardware/sync.h"
 #include "pio_usb_configuration.h"
 #include "usb_definitions.h"
+#include "usb_crc.h"
 #include <stdint.h>
 
 enum {
@@ -55,10 +57,12 @@ typedef struct {
   uint sm_tx;
   uint offset_tx;
   uint tx_ch;
+  uint8_t tx_len_shift; // 0: 8bit TX DMA, 2: 32bit TX DMA
 
   PIO pio_usb_rx; // could not set to volatile
   uint sm_rx;
   uint offset_rx;
+  int8_t rx_ch; // DMA channel draining RX FIFO, -1: CPU reads FIFO
   uint sm_eop;
   uint offset_eop;
   uint tx_reset_instr;
@@ -80,8 +84,11 @@ typedef struct {
   pio_clk_div_t clk_div_ls_rx;
 
   bool need_pre;
+  bool rx_word; // decoder pushes 32bit words while receiving data packets
+  uint8_t rx_timeout_us; // response timeout at current bus speed
+  uint32_t rx_bs_err_cnt; // bit stuffing errors, only with usb_nrzi_decoder_bs
 
-  uint8_t usb_rx_buffer[128];
+  uint8_t usb_rx_buffer[128] __attribute__((aligned(4)));
 } pio_port_t;
 
 //--------------------------------------------------------------------+
@@ -112,10 +119,18 @@ extern pio_port_t pio_port[1];
 #define IRQ_TX_EOP_MASK (1 << IRQ_TX_EOP)
 #define IRQ_TX_ALL_MASK (IRQ_TX_EOP_MASK)
 #define IRQ_RX_COMP_MASK (1 << IRQ_RX_EOP)
+#define IRQ_RX_BS_ERR_MASK (1 << IRQ_RX_BS_ERR)
+#define IRQ_RX_END_MASK (IRQ_RX_COMP_MASK | IRQ_RX_BS_ERR_MASK)
 #define IRQ_RX_ALL_MASK                                             \
   ((1 << IRQ_RX_EOP) | (1 << IRQ_RX_BS_ERR) | (1 << IRQ_RX_START) | \
    (1 << DECODER_TRIGGER))
 
+#define PIO_USB_BIT_TIMES_TO_US(bits, khz) (((bits) * 1000 + (khz) - 1) / (khz))
+#define PIO_USB_RX_TIMEOUT_FS_US                                               \
+  PIO_USB_BIT_TIMES_TO_US(PIO_USB_RX_TIMEOUT_BITS, 12000)
+#define PIO_USB_RX_TIMEOUT_LS_US                                               \
+  PIO_USB_BIT_TIMES_TO_US(PIO_USB_RX_TIMEOUT_BITS, 1500)
+
 #define SM_SET_CLKDIV(pio, sm, div)                                            \
   pio_sm_set_clkdiv_int_frac(pio, sm, div.div_int, div.div_frac)
 #define SM_SET_CLKDIV_MAXSPEED(pio, sm)                                        \
@@ -126,8 +141,13 @@ void pio_usb_bus_init(pio_port_t *pp, const pio_usb_configuration_t *c,
 
 void pio_usb_bus_start_receive(const pio_port_t *pp);
 void pio_usb_bus_prepare_receive(const pio_port_t *pp);
-int pio_usb_bus_receive_packet_and_handshake(pio_port_t *pp, uint8_t handshake);
-void pio_usb_bus_usb_transfer(const pio_port_t *pp, uint8_t *data,
+#define PIO_USB_RX_ERR_BS (-2) // bit stuffing error, no handshake sent
+#define PIO_USB_XACT_NAK 1 // host transaction NAKed
+#define PIO_USB_NO_HANDSHAKE 0 // isochronous, receive without handshake
+int pio_usb_bus_receive_packet_and_handshake(pio_port_t *pp, uint8_t handshake,
+                                             uint8_t *buffer,
+                                             uint16_t buffer_len);
+void pio_usb_bus_usb_transfer(const pio_port_t *pp, const uint8_t *data,
                               uint16_t len);
 
 uint8_t pio_usb_bus_wait_handshake(pio_port_t *pp);
@@ -135,6 +155,16 @@ void pio_usb_bus_send_handshake(const pio_port_t *pp, uint8_t pid);
 void pio_usb_bus_send_token(const pio_port_t *pp, uint8_t token, uint8_t addr,
                             uint8_t ep_num);
 
+// Jump TX SM to the start of a packet. With 32bit TX the K padding after
+// EOP can still be in OSR, e.g. when the SM is stopped after PRE. Restart
+// empties OSR so that nothing is sent before SYNC.
+static __always_inline void pio_usb_bus_start_tx(const pio_port_t *pp) {
+  if (pp->tx_len_shift) {
+    pio_sm_restart(pp->pio_usb_tx, pp->sm_tx);
+  }
+  pio_sm_exec(pp->pio_usb_tx, pp->sm_tx, pp->tx_start_instr);
+}
+
 static __always_inline port_pin_status_t
 pio_usb_bus_get_line_state(root_port_t *root) {
   uint8_t dp = gpio_get(root->pin_dp) ? 0 : 1;
@@ -152,7 +182,11 @@ void pio_usb_ll_configure_endpoint(endpoint_t *ep,
 bool pio_usb_ll_transfer_start(endpoint_t *ep, uint8_t *buffer,
                                uint16_t buflen);
 bool pio_usb_ll_transfer_continue(endpoint_t *ep, uint16_t xferred_bytes);
+void pio_usb_ll_prepare_next_tx(endpoint_t *ep);
 void pio_usb_ll_transfer_complete(endpoint_t *ep, uint32_t flag);
+void pio_usb_ll_transfer_cancel(endpoint_t *ep);
+void pio_usb_ll_transfer_stream(endpoint_t *ep);
+bool pio_usb_ll_transfer_enqueue(endpoint_t *ep, pio_usb_xfer_desc_t *desc);
 
 static inline __force_inline uint16_t
 pio_usb_ll_get_transaction_len(endpoint_t *ep) {
@@ -160,14 +194,319 @@ pio_usb_ll_get_transaction_len(endpoint_t *ep) {
   return (remaining < ep->size) ? remaining : ep->size;
 }
 
+// Bit times of a transaction carrying len bytes: token, data packet with
+// worst case bit stuffing, handshake, their EOPs and two turnarounds
+#define PIO_USB_TRANSACTION_BITS(len)                                          \
+  (32 + (32 + (len) * 8) * 7 / 6 + 16 + 3 * 3 + 2 * 18)
+// CPU time between transactions, preparing receiver and encoding
+#define PIO_USB_TRANSACTION_OVERHEAD_US 10
+
+static inline __force_inline uint16_t
+pio_usb_ll_transaction_time_us(endpoint_t *ep, bool fullspeed) {
+  uint32_t const bits = PIO_USB_TRANSACTION_BITS(ep->size);
+  return (fullspeed ? (bits + 11) / 12 : (bits * 2 + 2) / 3) +
+         PIO_USB_TRANSACTION_OVERHEAD_US;
+}
+
+// Polling period of an interrupt endpoint in frames: bInterval rounded down
+// to a power of two, at most PIO_USB_PERIODIC_FRAMES
+static inline __force_inline uint8_t
+pio_usb_ll_periodic_period(uint8_t interval) {
+  uint8_t period = 1;
+  while (period * 2 <= interval && period * 2 <= PIO_USB_PERIODIC_FRAMES) {
+    period *= 2;
+  }
+  return period;
+}
+
+// Phase in [0, period) whose frames of the periodic schedule have the lowest
+// peak load, then the lowest total load
+static inline uint8_t pio_usb_ll_periodic_phase(uint16_t const *load_us,
+                                                uint8_t period) {
+  uint8_t best = 0;
+  uint32_t best_peak = UINT32_MAX;
+  uint32_t best_total = UINT32_MAX;
+
+  for (uint8_t phase = 0; phase < period; phase++) {
+    uint32_t peak = 0;
+    uint32_t total = 0;
+    for (int frame = phase; frame < PIO_USB_PERIODIC_FRAMES; frame += period) {
+      peak = load_us[frame] > peak ? load_us[frame] : peak;
+      total += load_us[frame];
+    }
+    if (peak < best_peak || (peak == best_peak && total < best_total)) {
+      best = phase;
+      best_peak = peak;
+      best_total = total;
+    }
+  }
+
+  return best;
+}
+
+#if PIO_USB_COMPLETION_RING_CNT
+// Completion ring of a root port has one producer, the frame ISR, and one
+// consumer, the task. Indices run freely modulo 256. Barriers order record
+// and index accesses between the two cores.
+static inline __force_inline bool
+pio_usb_ll_completion_push(root_port_t *root,
+                           pio_usb_completion_t const *rec) {
+  uint8_t const wr = root->completion_wr;
+  if ((uint8_t)(wr - root->completion_rd) == PIO_USB_COMPLETION_RING_CNT) {
+    root->completion_drop_cnt++;
+    return false;
+  }
+
+  root->completion[wr & (PIO_USB_COMPLETION_RING_CNT - 1)] = *rec;
+  __dmb(); // record before index
+  root->completion_wr = wr + 1;
+
+  return true;
+}
+
+static inline uint8_t pio_usb_ll_completion_pop(root_port_t *root,
+                                                pio_usb_completion_t *recs,
+                                                uint8_t max) {
+  uint8_t const wr = root->completion_wr;
+  uint8_t rd = root->completion_rd;
+  uint8_t cnt = 0;
+
+  __dmb(); // index before records
+  while (rd != wr && cnt < max) {
+    recs[cnt++] = root->completion[rd & (PIO_USB_COMPLETION_RING_CNT - 1)];
+    rd++;
+  }
+  __dmb(); // records before releasing their slots
+  root->completion_rd = rd;
+
+  return cnt;
+}
+#endif
+
+// Append desc to the transfer queue of ep. Returns false behind a transfer
+// of pio_usb_ll_transfer_start(). *start is set if the queue was empty, then
+// the caller sets up desc and activates ep.
+static inline bool pio_usb_ll_xfer_queue_add(endpoint_t *ep, spin_lock_t *lock,
+                                             pio_usb_xfer_desc_t *desc,
+                                             bool *start) {
+  uint32_t const save = spin_lock_blocking(lock);
+  if (ep->has_transfer && ep->xfer_head == NULL) {
+    spin_unlock(lock, save);
+    return false;
+  }
+
+  desc->next = NULL;
+  *start = (ep->xfer_tail == NULL);
+  if (*start) {
+    ep->xfer_head = desc;
+  } else {
+    ep->xfer_tail->next = desc;
+  }
+  ep->xfer_tail = desc;
+  spin_unlock(lock, save);
+
+  return true;
+}
+
+// Take the completed head off the queue of ep and record its result. Returns
+// NULL if the queue is gone, e.g. cancelled on the other core. On success
+// *next is the descriptor to set up, otherwise the rest of the queue is moved
+// to *flushed. Without next, ep is no longer active in root.
+static inline pio_usb_xfer_desc_t *pio_usb_ll_xfer_queue_complete(
+    endpoint_t *ep, spin_lock_t *lock, root_port_t *root, uint32_t ep_mask,
+    uint32_t flag, pio_usb_xfer_desc_t **next, pio_usb_xfer_desc_t **flushed) {
+  *next = NULL;
+  *flushed = NULL;
+
+  uint32_t const save = spin_lock_blocking(lock);
+  pio_usb_xfer_desc_t *done = ep->xfer_head;
+  if (done == NULL) {
+    spin_unlock(lock, save);
+    return NULL;
+  }
+
+  if (flag == PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) {
+    *next = done->next;
+  } else {
+    *flushed = done->next;
+  }
+  ep->xfer_head = *next;
+  if (*next == NULL) {
+    ep->xfer_tail = NULL;
+    ep->has_transfer = false;
+    root->ep_active &= ~ep_mask;
+  }
+  done->actual_len = ep->actual_len;
+  done->flag = flag;
+  spin_unlock(lock, save);
+
+  return done;
+}
+
+// Call back done, then the descriptors flushed after it. A callback may
+// queue its descriptor again.
+static inline void pio_usb_ll_xfer_queue_notify(pio_usb_xfer_desc_t *done,
+                                                pio_usb_xfer_desc_t *flushed) {
+  if (done->cb) {
+    done->cb(done);
+  }
+  while (flushed) {
+    pio_usb_xfer_desc_t *desc = flushed;
+    flushed = desc->next;
+    desc->actual_len = 0;
+    desc->flag = done->flag;
+    if (desc->cb) {
+      desc->cb(desc);
+    }
+  }
+}
+
+// Lowest bit of *mask, which is cleared. *mask must not be 0.
+static inline __force_inline uint8_t pio_usb_ll_pop_ep(uint32_t *mask) {
+  uint8_t const idx = __builtin_ctz(*mask);
+  *mask &= *mask - 1;
+  return idx;
+}
+
+// Lowest bit of mask after idx, wrapping around. mask must not be 0.
+static inline __force_inline uint8_t pio_usb_ll_next_ep_rr(uint32_t mask,
+                                                           uint8_t idx) {
+  uint32_t const after = mask & ~((2u << idx) - 1);
+  return __builtin_ctz(after ? after : mask);
+}
+
+// Round robin over bulk and control endpoints of pool set in active until
+// the next transaction would not end within budget_us of elapsed_us(). An
+// endpoint which makes no progress (NAK, error) waits for the next frame.
+static __always_inline void pio_usb_ll_budget_round_robin(
+    endpoint_t *pool, const volatile uint32_t *active, uint8_t *rr_idx,
+    bool fullspeed, uint32_t budget_us, uint32_t (*elapsed_us)(void *ctx),
+    void (*transaction)(void *ctx, endpoint_t *ep), void *ctx) {
+  uint32_t skip = 0;
+
+  while (true) {
+    uint32_t const candidate = *active & ~skip;
+    if (candidate == 0) {
+      break;
+    }
+
+    uint8_t const ep_idx = pio_usb_ll_next_ep_rr(candidate, *rr_idx);
+    endpoint_t *ep = &pool[ep_idx];
+    uint8_t const type = ep->attr & 0x03;
+    if (!ep->has_transfer || ep->transfer_aborted ||
+        type == EP_ATTR_INTERRUPT || type == EP_ATTR_ISOCHRONOUS) {
+      skip |= 1u << ep_idx;
+      continue;
+    }
+
+    uint32_t const xact_end =
+        elapsed_us(ctx) +
+        pio_usb_ll_transaction_time_us(ep, fullspeed && !ep->need_pre);
+    if (xact_end > budget_us) {
+      break;
+    }
+
+    // data_id toggles on every data packet, also into the next queued
+    // transfer which starts over at actual_len 0
+    uint8_t const data_id = ep->data_id;
+    transaction(ctx, ep);
+    *rr_idx = ep_idx;
+    if (ep->has_transfer && ep->data_id == data_id) {
+      skip |= 1u << ep_idx;
+    }
+  }
+}
+
 enum {
   PIO_USB_TX_ENCODED_DATA_SE0 = 0,
   PIO_USB_TX_ENCODED_DATA_K = 1,
   PIO_USB_TX_ENCODED_DATA_COMP = 2,
   PIO_USB_TX_ENCODED_DATA_J = 3,
 };
+void pio_usb_ll_encode_tx_init(bool word_align);
 uint8_t pio_usb_ll_encode_tx_data(uint8_t const *buffer, uint8_t buffer_len,
                                   uint8_t *encoded_data);
+uint16_t pio_usb_ll_encode_tx_packet(uint8_t pid, uint8_t const *data,
+                                    uint16_t len, uint8_t *encoded_data);
+uint8_t pio_usb_ll_encode_token(uint8_t pid, uint8_t addr, uint8_t ep_num,
+                                uint8_t *encoded_data);
+uint8_t pio_usb_ll_encode_sof(uint16_t frame_number, uint8_t *encoded_data);
+
+// Packets which never change, encoded at build time
+enum {
+  PIO_USB_PACKET_ACK = 0,
+  PIO_USB_PACKET_NAK,
+  PIO_USB_PACKET_STALL,
+  PIO_USB_PACKET_PRE,
+  PIO_USB_PACKET_DATA0_ZLP,
+  PIO_USB_PACKET_DATA1_ZLP,
+  PIO_USB_PACKET_CNT,
+};
+
+typedef struct {
+  uint8_t encoded[12] __attribute__((aligned(4))); // padded with K
+  uint8_t len; // length without word padding
+} pio_usb_const_packet_t;
+
+extern const pio_usb_const_packet_t pio_usb_const_packet[PIO_USB_PACKET_CNT];
+
+static inline __force_inline uint8_t
+pio_usb_ll_const_packet_len(const pio_port_t *pp, uint8_t id) {
+  uint8_t const align = (1u << pp->tx_len_shift) - 1;
+  return (pio_usb_const_packet[id].len + align) & ~align;
+}
+
+// Byte RX mode: data byte after SYNC and PID goes straight to buffer. The
+// last two bytes are held back in crc_field since they turn out to be CRC16
+// at EOP.
+static __always_inline uint16_t pio_usb_ll_receive_data_byte(
+    uint8_t *buffer, uint16_t buffer_len, uint16_t idx, uint8_t data,
+    uint16_t *crc, uint16_t *crc_field) {
+  if ((uint16_t)(idx - 4) < buffer_len) {
+    buffer[idx - 4] = *crc_field & 0xff;
+  }
+  *crc_field = (*crc_field >> 8) | (data << 8);
+  *crc = update_usb_crc16(*crc, data);
+  return idx + 1;
+}
+
+// Word RX mode: the decoder pushes 32bit words with the first received byte
+// in LSB. Bits left at EOP are pushed by PUSH iffull with these thresholds in
+// turn, each byte count with and without the stray bit decoded from SE0.
+#define PIO_USB_RX_TAIL_PROBE_CNT 6
+extern const uint8_t pio_usb_rx_tail_probe[PIO_USB_RX_TAIL_PROBE_CNT];
+
+// Store a received word and add the bytes after SYNC and PID to CRC16. A
+// word past buffer_len is only counted, the caller rejects idx > buffer_len.
+static __always_inline uint16_t pio_usb_ll_decode_rx_word(uint8_t *buffer,
+                                                          uint16_t buffer_len,
+                                                          uint16_t idx,
+                                                          uint32_t word,
+                                                          uint16_t *crc) {
+  if (idx >= 2) {
+    *crc = update_usb_crc16_word(*crc, word);
+    if (idx + 4 <= buffer_len) {
+      buffer[idx] = word;
+      buffer[idx + 1] = word >> 8;
+      buffer[idx + 2] = word >> 16;
+      buffer[idx + 3] = word >> 24;
+    }
+    return idx + 4;
+  }
+
+  for (int i = 0; i < 4; i++) {
+    uint8_t const data = word >> (8 * i);
+    if (idx >= 2) {
+      *crc = update_usb_crc16(*crc, data);
+    }
+    buffer[idx++] = data;
+  }
+  return idx;
+}
+
+uint16_t pio_usb_ll_decode_rx_tail(uint8_t *buffer, uint16_t buffer_len,
+                                   uint16_t idx, uint32_t word, uint8_t bits,
+                                   uint16_t *crc);
 
 //--------------------------------------------------------------------
 // Host Controller functions
@@ -188,8 +527,28 @@ bool pio_usb_host_send_setup(uint8_t root_idx, uint8_t device_address,
 bool pio_usb_host_endpoint_transfer(uint8_t root_idx, uint8_t device_address,
                                     uint8_t ep_address, uint8_t *buffer,
                                     uint16_t buflen);
+bool pio_usb_host_endpoint_set_nak_policy(uint8_t root_idx,
+                                           uint8_t device_address,
+                                           uint8_t ep_address,
+                                           pio_usb_nak_policy_t const *policy);
+bool pio_usb_host_endpoint_get_nak_count(uint8_t root_idx,
+                                         uint8_t device_address,
+                                         uint8_t ep_address, uint32_t *nak,
+                                         uint32_t *deferred);
 bool pio_usb_host_endpoint_abort_transfer(uint8_t root_idx, uint8_t device_address,
                                           uint8_t ep_address);
+bool pio_usb_host_endpoint_enqueue(uint8_t root_idx, uint8_t device_address,
+                                   uint8_t ep_address,
+                                   pio_usb_xfer_desc_t *desc);
+#if PIO_USB_COMPLETION_RING_CNT
+uint8_t pio_usb_host_get_completions(uint8_t root_idx,
+                                     pio_usb_completion_t *recs, uint8_t max);
+#endif
+bool pio_usb_host_endpoint_iso_start(uint8_t root_idx, uint8_t device_address,
+                                     uint8_t ep_address,
+                                     pio_usb_iso_ring_t *ring);
+bool pio_usb_host_endpoint_iso_stop(uint8_t root_idx, uint8_t device_address,
+                                    uint8_t ep_address);
 
 //--------------------------------------------------------------------
 // Device Controller functions
@@ -3,8 +3,39 @@
 #include <stdint.h>
 #include "pico/stdlib.h"
 
+// Bytes calc_usb_crc16() processes per table step: 1, 4 or 8. Slicing by 4
+// and 8 read words from little endian memory and add 1.5KB and 3.5KB of
+// tables to RAM. update_usb_crc16_word() of the 32bit RX path uses the
+// slicing by 4 tables of both.
+#ifndef PIO_USB_CRC16_SLICE
+#define PIO_USB_CRC16_SLICE 1
+#endif
+#if PIO_USB_CRC16_SLICE != 1 && PIO_USB_CRC16_SLICE != 4 &&                   \
+    PIO_USB_CRC16_SLICE != 8
+#error "PIO_USB_CRC16_SLICE must be 1, 4 or 8"
+#endif
+
+// Use 2KB RAM table for the CRC5 of token and SOF packets instead of
+// calculating it per packet
+#ifndef PIO_USB_CRC5_TABLE
+#define PIO_USB_CRC5_TABLE 0
+#endif
+
 // Calc CRC5-USB of 11bit data
 uint8_t calc_usb_crc5(uint16_t data);
+
+// Second byte of token and SOF packets: CRC5 of 11bit data and data bit 8-10
+#if PIO_USB_CRC5_TABLE
+extern const uint8_t crc5_token_tbl[2048];
+static inline uint8_t __time_critical_func(usb_crc5_token_byte)(uint16_t data) {
+  return crc5_token_tbl[data & 0x7ff];
+}
+#else
+static inline uint8_t __time_critical_func(usb_crc5_token_byte)(uint16_t data) {
+  data &= 0x7ff;
+  return (calc_usb_crc5(data) << 3) | (data >> 8);
+}
+#endif
 // Calc CRC16-USB of array
 uint16_t calc_usb_crc16(const uint8_t *data, uint16_t len);
 
@@ -12,4 +43,26 @@ extern const uint16_t crc16_tbl[256];
 static inline uint16_t __time_critical_func(update_usb_crc16)(uint16_t crc, uint8_t data) {
   crc = (crc >> 8) ^ crc16_tbl[(crc ^ data) & 0xff];
   return crc;
-}
\ No newline at end of file
+}
+
+#if PIO_USB_CRC16_SLICE > 1
+extern const uint16_t crc16_slice_tbl[PIO_USB_CRC16_SLICE - 1][256];
+#endif
+
+// Update CRC16 by 4 bytes, first byte in LSB
+static inline uint16_t __time_critical_func(update_usb_crc16_word)(uint16_t crc, uint32_t data) {
+#if PIO_USB_CRC16_SLICE > 1
+  data ^= crc;
+  crc = crc16_slice_tbl[2][data & 0xff] ^ crc16_slice_tbl[1][(data >> 8) & 0xff] ^
+        crc16_slice_tbl[0][(data >> 16) & 0xff] ^ crc16_tbl[data >> 24];
+#else
+  crc = update_usb_crc16(crc, data & 0xff);
+  crc = update_usb_crc16(crc, (data >> 8) & 0xff);
+  crc = update_usb_crc16(crc, (data >> 16) & 0xff);
+  crc = update_usb_crc16(crc, data >> 24);
+#endif
+  return crc;
+}
+// CRC16 register after data followed by its valid CRC16, so a received
+// packet can be checked once after EOP without knowing where data ends
+#define USB_CRC16_RESIDUE 0xb001
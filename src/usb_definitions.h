@@ -53,6 +53,38 @@ typedef struct {
   volatile setup_transfer_stage_t stage;
 } control_pipe_t;
 
+// Frame slots of a host isochronous endpoint, one packet per slot. Host fills
+// IN slots and drains OUT slots at wr and rd respectively, the application
+// does the other side. Indices run freely modulo 256.
+typedef struct {
+  uint8_t *buf;               // slot_cnt slots of slot_size bytes
+  uint16_t *len;              // packet length of each slot
+  uint16_t slot_size;         // at least max packet size for IN
+  uint8_t slot_cnt;           // power of two up to 128
+  volatile uint8_t rd;        // next slot to consume
+  volatile uint8_t wr;        // next slot to fill
+  volatile uint32_t miss_cnt; // IN: no free slot, OUT: no packet queued
+  volatile uint32_t err_cnt;  // IN: no or broken packet
+} pio_usb_iso_ring_t;
+
+typedef struct {
+  uint8_t retry;   // retries in the same frame after NAK
+  uint8_t gap_us;  // minimum time from NAK to retry
+  uint16_t end_us; // no retry finishes later than this from SOF
+} pio_usb_nak_policy_t;
+
+// Transfer queued on a host bulk or interrupt endpoint. It belongs to the
+// caller from completion on, cb is called in interrupt context.
+typedef struct pio_usb_xfer_desc {
+  uint8_t *buf;
+  uint16_t len;
+  volatile uint16_t actual_len; // set on completion
+  volatile uint32_t flag;       // PIO_USB_INTS_ENDPOINT_*_BITS on completion
+  void (*cb)(struct pio_usb_xfer_desc *desc); // may be NULL
+  void *ctx;                                  // for cb
+  struct pio_usb_xfer_desc *next;
+} pio_usb_xfer_desc_t;
+
 typedef struct {
   volatile uint8_t root_idx;
   volatile uint8_t dev_addr;
@@ -64,8 +96,9 @@ typedef struct {
   volatile uint16_t size;
 
   volatile uint8_t attr;
-  volatile uint8_t interval;
-  volatile uint8_t interval_counter;
+  volatile uint8_t interval; // host interrupt: polling period in frames
+  volatile uint8_t interval_phase; // host interrupt: frame in the period
+  uint16_t periodic_us; // bus time reserved in the periodic schedule
   volatile uint8_t data_id; // data0 or data1
 
   volatile bool stalled;
@@ -73,11 +106,30 @@ typedef struct {
   volatile bool transfer_started;
   volatile bool transfer_aborted;
 
-  uint8_t buffer[(64 + 4) * 2 * 7 / 6 + 2];
-  uint8_t encoded_data_len;
+  // ping-pong slots of encoded packets. encoded_data[buffer_idx] is sent
+  // next, the other one holds the following packet if next_prepared is set.
+  // encoded_data points to buffer (slot 0), the TX buffer shared by all
+  // endpoints (slot 1) or a prebuilt zero length packet.
+  uint8_t buffer[(64 + 4) * 2 * 7 / 6 + 2] __attribute__((aligned(4)));
+  const uint8_t *encoded_data[2];
+  uint8_t encoded_data_len[2];
+  volatile uint8_t buffer_idx;
+  volatile bool next_prepared;
+  uint8_t token_encoded[4 * 2 * 7 / 6 + 3] __attribute__((aligned(4)));
+  uint8_t token_encoded_len;
+  uint8_t token_pid; // PID of token_encoded, 0 if not encoded yet
   uint8_t *app_buf;
   uint16_t total_len;
   uint16_t actual_len;
+
+  pio_usb_nak_policy_t nak_policy; // host bulk and control
+  volatile uint32_t nak_cnt;       // NAKs received
+  volatile uint32_t nak_defer_cnt; // NAKs left for the next frame
+
+  pio_usb_iso_ring_t *iso_ring; // host isochronous stream
+  pio_usb_xfer_desc_t *volatile xfer_head; // queued, head is in progress
+  pio_usb_xfer_desc_t *xfer_tail;
+  struct struct_usb_device_t *device; // host: device this endpoint belongs to
 } endpoint_t;
 
 typedef enum {
@@ -88,6 +140,18 @@ typedef enum {
 } usb_device_event_t;
 
 typedef struct struct_usb_device_t usb_device_t;
+
+typedef struct {
+  uint8_t ep_idx;      // endpoint pool index
+  uint8_t flag;        // PIO_USB_INTS_ENDPOINT_{COMPLETE,ERROR,STALLED}_BITS
+  uint16_t actual_len; // bytes transferred
+  uint32_t frame;      // host frame number at completion
+} pio_usb_completion_t;
+
+// Slot of endpoint address in usb_device_t::host_ep_id, IN at odd index
+#define PIO_USB_EP_ADDR_IDX(ep_address)                                        \
+  ((((ep_address) & 0x0f) << 1) | (((ep_address) >> 7) & 0x01))
+
 typedef struct struct_root_port_t {
   volatile bool initialized;
   volatile bool addr0_exists;
@@ -108,6 +172,16 @@ typedef struct struct_root_port_t {
   volatile uint32_t ep_error;
   volatile uint32_t ep_stalled;
   volatile uint32_t ep_continue;
+  volatile uint32_t ep_active; // endpoints with pending transfer
+  volatile uint32_t ep_iso; // isochronous endpoints, served first in frame
+
+#if PIO_USB_COMPLETION_RING_CNT
+  // completion records, written in interrupt context and read by task
+  pio_usb_completion_t completion[PIO_USB_COMPLETION_RING_CNT];
+  volatile uint8_t completion_wr;
+  volatile uint8_t completion_rd;
+  volatile uint32_t completion_drop_cnt;
+#endif
 
   // device only
   uint8_t dev_addr;
@@ -126,6 +200,7 @@ struct struct_usb_device_t {
   volatile bool is_root;
   control_pipe_t control_pipe;
   uint8_t endpoint_id[PIO_USB_DEV_EP_CNT];
+  uint8_t host_ep_id[32]; // host: pool index + 1 by PIO_USB_EP_ADDR_IDX()
   uint8_t child_devices[PIO_USB_HUB_PORT_CNT];
   struct struct_usb_device_t *parent_device;
   uint8_t parent_port;
@@ -0,0 +1,247 @@
+/**
+ * Copyright (c) 2021 sekigon-gonnoc
+ */
+
+#pragma GCC push_options
+#pragma GCC optimize("-O3")
+
+#include <stdint.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+
+#include "pio_usb_ll.h"
+#include "usb_crc.h"
+
+// Byte encode table indexed by [run of consecutive 1 bits][input byte].
+// Entries assume the line is in K state before the byte. Since J and K
+// symbols only differ in bit1, the J state variant is made by XOR with
+// 0b10 on every symbol.
+//  bit 0-19 : encoded symbols, right aligned, first symbol is MSB side
+//  bit 20-23: number of symbols (8 + number of stuffed bits)
+//  bit 24-26: run of consecutive 1 bits after this byte
+//  bit 27   : line state is flipped after this byte
+#define NRZI_TBL_COUNT_POS 20
+#define NRZI_TBL_RUN_POS 24
+#define NRZI_TBL_FLIP_POS 27
+#define NRZI_SYMBOL_INVERT 0x000aaaaau
+
+static uint32_t nrzi_encode_tbl[6][256];
+
+// 0: encoded packets end at byte boundary, 3: at word boundary for 32bit DMA
+static uint8_t encode_align_mask;
+
+// Encoded by pio_usb_ll_encode_tx_data(), test/ checks they still match
+const pio_usb_const_packet_t __not_in_flash("tx_packet")
+    pio_usb_const_packet[PIO_USB_PACKET_CNT] = {
+  [PIO_USB_PACKET_ACK] = {{0xdd, 0xdf, 0x5d, 0x7f, 0x25, 0x55, 0x55, 0x55}, 5},
+  [PIO_USB_PACKET_NAK] = {{0xdd, 0xdf, 0x5f, 0xd7, 0x25, 0x55, 0x55, 0x55}, 5},
+  [PIO_USB_PACKET_STALL] = {{0xdd, 0xdf, 0x55, 0x77, 0x25, 0x55, 0x55, 0x55}, 5},
+  [PIO_USB_PACKET_PRE] = {{0xdd, 0xdf, 0x7f, 0xf7, 0x25, 0x55, 0x55, 0x55}, 5},
+  [PIO_USB_PACKET_DATA0_ZLP] = {{0xdd, 0xdf, 0xf7, 0x7f, 0x77, 0x77, 0x77, 0x77,
+                                 0x25, 0x55, 0x55, 0x55}, 9},
+  [PIO_USB_PACKET_DATA1_ZLP] = {{0xdd, 0xdf, 0xf5, 0xd7, 0x77, 0x77, 0x77, 0x77,
+                                 0x25, 0x55, 0x55, 0x55}, 9},
+};
+
+const uint8_t pio_usb_rx_tail_probe[PIO_USB_RX_TAIL_PROBE_CNT] = {
+    25, 24, 17, 16, 9, 8,
+};
+
+typedef struct {
+  uint8_t *dst;
+  uint32_t acc;
+  uint32_t acc_bits;
+  uint32_t run;
+  uint32_t invert;
+} nrzi_encoder_t;
+
+// SYNC and SOF PID never change. Keep their encoded symbols and the encoder
+// state after them so that only frame number and CRC5 are encoded per frame.
+static uint8_t sof_prefix_encoded[4];
+static nrzi_encoder_t sof_prefix_state;
+
+static __always_inline void nrzi_encode_byte(nrzi_encoder_t *enc,
+                                             uint8_t byte) {
+  uint32_t const entry = nrzi_encode_tbl[enc->run][byte];
+  uint32_t const bits = (entry >> (NRZI_TBL_COUNT_POS - 1)) & 0x1e;
+
+  enc->acc =
+      (enc->acc << bits) | ((entry ^ enc->invert) & ((1u << bits) - 1));
+  enc->acc_bits += bits;
+  enc->run = (entry >> NRZI_TBL_RUN_POS) & 0x07;
+  enc->invert ^=
+      (0u - ((entry >> NRZI_TBL_FLIP_POS) & 1)) & NRZI_SYMBOL_INVERT;
+
+  while (enc->acc_bits >= 8) {
+    enc->acc_bits -= 8;
+    *enc->dst++ = enc->acc >> enc->acc_bits;
+  }
+}
+
+static __always_inline void nrzi_encode_eop(nrzi_encoder_t *enc,
+                                            uint8_t const *start) {
+  // EOP, then terminate buffers with K
+  enc->acc = (enc->acc << 6) | (PIO_USB_TX_ENCODED_DATA_SE0 << 4) |
+             (PIO_USB_TX_ENCODED_DATA_COMP << 2) | PIO_USB_TX_ENCODED_DATA_K;
+  enc->acc_bits += 6;
+  while (enc->acc_bits & 0x07) {
+    enc->acc = (enc->acc << 2) | PIO_USB_TX_ENCODED_DATA_K;
+    enc->acc_bits += 2;
+  }
+  while (enc->acc_bits) {
+    enc->acc_bits -= 8;
+    *enc->dst++ = enc->acc >> enc->acc_bits;
+  }
+  while ((enc->dst - start) & encode_align_mask) {
+    *enc->dst++ = PIO_USB_TX_ENCODED_DATA_K * 0x55; // KKKK
+  }
+}
+
+void pio_usb_ll_encode_tx_init(bool word_align) {
+  encode_align_mask = word_align ? 0x03 : 0x00;
+
+  for (int run = 0; run < 6; run++) {
+    for (int byte = 0; byte < 256; byte++) {
+      uint32_t symbols = 0;
+      uint32_t count = 0;
+      int line_k = 1;
+      int ones = run;
+
+      for (int b = 0; b < 8; b++) {
+        if (byte & (1 << b)) {
+          ones++;
+        } else {
+          line_k ^= 1;
+          ones = 0;
+        }
+        symbols = (symbols << 2) | (line_k ? PIO_USB_TX_ENCODED_DATA_K
+                                           : PIO_USB_TX_ENCODED_DATA_J);
+        count++;
+
+        if (ones == 6) {
+          // stuff bit
+          line_k ^= 1;
+          ones = 0;
+          symbols = (symbols << 2) | (line_k ? PIO_USB_TX_ENCODED_DATA_K
+                                             : PIO_USB_TX_ENCODED_DATA_J);
+          count++;
+        }
+      }
+
+      nrzi_encode_tbl[run][byte] = symbols |
+                                   (count << NRZI_TBL_COUNT_POS) |
+                                   ((uint32_t)ones << NRZI_TBL_RUN_POS) |
+                                   ((uint32_t)!line_k << NRZI_TBL_FLIP_POS);
+    }
+  }
+
+  nrzi_encoder_t enc = {sof_prefix_encoded, 0, 0, 0, 0};
+  nrzi_encode_byte(&enc, USB_SYNC);
+  nrzi_encode_byte(&enc, USB_PID_SOF);
+  sof_prefix_state = enc;
+}
+
+// Encode transfer data to 2bit sequence represents TX PIO instruction address
+uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_data)(
+    uint8_t const *buffer, uint8_t buffer_len, uint8_t *encoded_data) {
+  nrzi_encoder_t enc = {encoded_data, 0, 0, 0, 0};
+
+  for (int idx = 0; idx < buffer_len; idx++) {
+    nrzi_encode_byte(&enc, buffer[idx]);
+  }
+  nrzi_encode_eop(&enc, encoded_data);
+
+  return enc.dst - encoded_data;
+}
+
+// Encode SYNC, PID, data, CRC16 and EOP. CRC16 is updated while encoding,
+// or taken from sliced calc_usb_crc16() before when its tables are built in.
+uint16_t __no_inline_not_in_flash_func(pio_usb_ll_encode_tx_packet)(
+    uint8_t pid, uint8_t const *data, uint16_t len, uint8_t *encoded_data) {
+  nrzi_encoder_t enc = {encoded_data, 0, 0, 0, 0};
+#if PIO_USB_CRC16_SLICE > 1
+  uint16_t const crc = calc_usb_crc16(data, len);
+#else
+  uint16_t crc = 0xffff;
+#endif
+
+  nrzi_encode_byte(&enc, USB_SYNC);
+  nrzi_encode_byte(&enc, pid);
+  for (int idx = 0; idx < len; idx++) {
+    uint8_t const byte = data[idx];
+#if PIO_USB_CRC16_SLICE == 1
+    crc = update_usb_crc16(crc, byte);
+#endif
+    nrzi_encode_byte(&enc, byte);
+  }
+#if PIO_USB_CRC16_SLICE == 1
+  crc ^= 0xffff;
+#endif
+  nrzi_encode_byte(&enc, crc & 0xff);
+  nrzi_encode_byte(&enc, crc >> 8);
+  nrzi_encode_eop(&enc, encoded_data);
+
+  return enc.dst - encoded_data;
+}
+
+// Encode token packet (IN, OUT, SETUP) with CRC5
+uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_token)(
+    uint8_t pid, uint8_t addr, uint8_t ep_num, uint8_t *encoded_data) {
+  nrzi_encoder_t enc = {encoded_data, 0, 0, 0, 0};
+  uint16_t const dat = ((uint16_t)(ep_num & 0xf) << 7) | (addr & 0x7f);
+
+  nrzi_encode_byte(&enc, USB_SYNC);
+  nrzi_encode_byte(&enc, pid);
+  nrzi_encode_byte(&enc, dat & 0xff);
+  nrzi_encode_byte(&enc, usb_crc5_token_byte(dat));
+  nrzi_encode_eop(&enc, encoded_data);
+
+  return enc.dst - encoded_data;
+}
+
+// Encode SOF packet. Only the frame number field is encoded here, SYNC and
+// PID come from the prefix prepared in pio_usb_ll_encode_tx_init()
+uint8_t __no_inline_not_in_flash_func(pio_usb_ll_encode_sof)(
+    uint16_t frame_number, uint8_t *encoded_data) {
+  uint8_t const prefix_len = sof_prefix_state.dst - sof_prefix_encoded;
+  nrzi_encoder_t enc = sof_prefix_state;
+
+  memcpy(encoded_data, sof_prefix_encoded, prefix_len);
+  enc.dst = encoded_data + prefix_len;
+
+  frame_number &= 0x7ff;
+  nrzi_encode_byte(&enc, frame_number & 0xff);
+  nrzi_encode_byte(&enc, usb_crc5_token_byte(frame_number));
+  nrzi_encode_eop(&enc, encoded_data);
+
+  return enc.dst - encoded_data;
+}
+
+// Store bytes of the word pushed at EOP. It holds `bits` bits at MSB side
+// with the oldest one at the bottom, bits after the last byte are discarded.
+// Bytes past buffer_len are only counted as in pio_usb_ll_decode_rx_word().
+uint16_t __no_inline_not_in_flash_func(pio_usb_ll_decode_rx_tail)(
+    uint8_t *buffer, uint16_t buffer_len, uint16_t idx, uint32_t word,
+    uint8_t bits, uint16_t *crc) {
+  if (bits < 8) {
+    return idx;
+  }
+
+  word >>= 32 - bits;
+  for (int i = 0; i < bits / 8; i++) {
+    uint8_t const data = word;
+    if (idx >= 2) {
+      *crc = update_usb_crc16(*crc, data);
+    }
+    if (idx < buffer_len) {
+      buffer[idx] = data;
+    }
+    idx++;
+    word >>= 8;
+  }
+
+  return idx;
+}
+
+#pragma GCC pop_options
@@ -171,6 +171,49 @@ static inline pio_sm_config usb_nrzi_decoder_debug_program_get_default_config(ui
     sm_config_set_sideset(&c, 2, true, false);
     return c;
 }
+#endif
+
+// ------------------- //
+// usb_nrzi_decoder_bs //
+// ------------------- //
+
+#define usb_nrzi_decoder_bs_wrap_target 5
+#define usb_nrzi_decoder_bs_wrap 11
+
+#define usb_nrzi_decoder_bs_offset_start 5u
+
+static const uint16_t usb_nrzi_decoder_bs_program_instructions[] = {
+    0x00c3, //  0: jmp    pin, 3                     
+    0x0024, //  1: jmp    !x, 4                      
+    0x000b, //  2: jmp    11                         
+    0x002b, //  3: jmp    !x, 11                     
+    0xc001, //  4: irq    nowait 1                   
+            //     .wrap_target
+    0xe046, //  5: set    y, 6                       
+    0x20c4, //  6: wait   1 irq, 4                   
+    0x0060, //  7: jmp    !y, 0                      
+    0x00cc, //  8: jmp    pin, 12                    
+    0x002d, //  9: jmp    !x, 13                     
+    0x4061, // 10: in     null, 1                    
+    0xa029, // 11: mov    x, !x                      
+            //     .wrap
+    0x002a, // 12: jmp    !x, 10                     
+    0x40e1, // 13: in     osr, 1                     
+    0x0086, // 14: jmp    y--, 6                     
+};
+
+#if !PICO_NO_HARDWARE
+static const struct pio_program usb_nrzi_decoder_bs_program = {
+    .instructions = usb_nrzi_decoder_bs_program_instructions,
+    .length = 15,
+    .origin = -1,
+};
+
+static inline pio_sm_config usb_nrzi_decoder_bs_program_get_default_config(uint offset) {
+    pio_sm_config c = pio_get_default_sm_config();
+    sm_config_set_wrap(&c, offset + usb_nrzi_decoder_bs_wrap_target, offset + usb_nrzi_decoder_bs_wrap);
+    return c;
+}
 
 #include "hardware/clocks.h"
 #if PICO_SDK_VERSION_MAJOR < 2
@@ -180,7 +223,7 @@ static __always_inline void pio_sm_set_jmp_pin(PIO pio, uint sm, uint jmp_pin) {
       (jmp_pin << PIO_SM0_EXECCTRL_JMP_PIN_LSB);
 }
 #endif
-static inline void usb_rx_fs_program_init(PIO pio, uint sm, uint offset, uint pin_dp, uint pin_dm, int pin_debug) {
+static inline void usb_rx_fs_program_init(PIO pio, uint sm, uint offset, uint pin_dp, uint pin_dm, int pin_debug, bool bs_check) {
   if (pin_dp < pin_dm) {
     pio_sm_set_consecutive_pindirs(pio, sm, pin_dp, 2, false);
   } else {
@@ -191,7 +234,11 @@ static inline void usb_rx_fs_program_init(PIO pio, uint sm, uint offset, uint pi
   gpio_set_inover(pin_dp, GPIO_OVERRIDE_INVERT);
   gpio_set_inover(pin_dm, GPIO_OVERRIDE_INVERT);
   pio_sm_config c;
-  if (pin_debug < 0) {
+  uint start = 0;
+  if (bs_check) {
+    c = usb_nrzi_decoder_bs_program_get_default_config(offset);
+    start = usb_nrzi_decoder_bs_offset_start;
+  } else if (pin_debug < 0) {
     c = usb_nrzi_decoder_program_get_default_config(offset);
   } else {
     c = usb_nrzi_decoder_debug_program_get_default_config(offset);
@@ -205,7 +252,7 @@ static inline void usb_rx_fs_program_init(PIO pio, uint sm, uint offset, uint pi
   // Shift to right, autopull enabled, 8bit
   sm_config_set_in_shift(&c, true, true, 8);
   sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_RX);
-  pio_sm_init(pio, sm, offset, &c);
+  pio_sm_init(pio, sm, offset + start, &c);
   pio_sm_exec(pio, sm, pio_encode_mov_not(pio_osr, pio_null));
   pio_sm_set_enabled(pio, sm, false);
 }
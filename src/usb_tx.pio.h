@@ -150,15 +150,16 @@ static inline pio_sm_config usb_tx_pre_dmdp_program_get_default_config(uint offs
     }
   }
   static inline void usb_tx_fs_program_init(PIO pio, uint sm, uint offset,
-                                         uint pin_dp, uint pin_dm) {
+                                         uint pin_dp, uint pin_dm,
+                                         uint pull_threshold) {
     pio_sm_set_pins_with_mask(pio, sm, (1 << pin_dp), ((1 << pin_dp) | (1 << pin_dm)));
     gpio_pull_down(pin_dp);
     gpio_pull_down(pin_dm);
     pio_gpio_init(pio, pin_dp);
     pio_gpio_init(pio, pin_dm);
     pio_sm_config c = usb_tx_dpdm_program_get_default_config(offset);
-    // shifts to left, autopull, 8bit
-    sm_config_set_out_shift(&c, false, true, 8);
+    // shifts to left, autopull, 8bit or 32bit
+    sm_config_set_out_shift(&c, false, true, pull_threshold);
     sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
     // run at 48MHz
     // clk_sys should be multiply of 12MHz
@@ -169,15 +170,16 @@ static inline pio_sm_config usb_tx_pre_dmdp_program_get_default_config(uint offs
     pio_sm_set_enabled(pio, sm, true);
   }
   static inline void usb_tx_ls_program_init(PIO pio, uint sm, uint offset,
-                                         uint pin_dp, uint pin_dm) {
+                                         uint pin_dp, uint pin_dm,
+                                         uint pull_threshold) {
     pio_sm_set_pins_with_mask(pio, sm, (1 << pin_dm), ((1 << pin_dp) | (1 << pin_dm)));
     gpio_pull_down(pin_dp);
     gpio_pull_down(pin_dm);
     pio_gpio_init(pio, pin_dp);
     pio_gpio_init(pio, pin_dm);
     pio_sm_config c = usb_tx_dmdp_program_get_default_config(offset);
-    // shifts to left, autopull, 8bit
-    sm_config_set_out_shift(&c, false, true, 8);
+    // shifts to left, autopull, 8bit or 32bit
+    sm_config_set_out_shift(&c, false, true, pull_threshold);
     sm_config_set_fifo_join(&c, PIO_FIFO_JOIN_TX);
     // run at 6MHz
     // clk_sys should be multiply of 12MHz
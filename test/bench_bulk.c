@@ -0,0 +1,167 @@
+// Simulate host frames against full-speed bulk IN devices and compare
+// throughput of one transaction per endpoint per frame with the budgeted
+// round robin of pio_usb_ll_budget_round_robin() used by pio_usb_host.c. Bus
+// time of each transaction is counted in bit times, the budget check uses
+// pio_usb_ll_transaction_time_us() as the firmware does.
+//
+// Devices are ready with a given probability per IN token, otherwise NAK.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pio_usb_ll.h"
+
+#define FRAME_CNT 1000
+#define FRAME_US 1000
+#define BUDGET_US 900
+#define EP_MAX 4
+#define TRANSFER_LEN 4096
+
+typedef struct {
+  endpoint_t ep[EP_MAX];
+  int ep_cnt;
+  int ready_percent;
+  uint32_t active;
+  uint32_t bytes[EP_MAX];
+  double now_us;
+  double max_frame_us;
+} sim_t;
+
+static void sim_transfer_start(sim_t *sim, int idx) {
+  endpoint_t *ep = &sim->ep[idx];
+  ep->total_len = TRANSFER_LEN;
+  ep->actual_len = 0;
+  ep->has_transfer = true;
+  sim->active |= 1u << idx;
+}
+
+// One IN transaction: DATA and ACK if device is ready, NAK otherwise
+static void sim_transaction(sim_t *sim, int idx) {
+  endpoint_t *ep = &sim->ep[idx];
+  uint32_t bits;
+
+  if (rand() % 100 < sim->ready_percent) {
+    uint16_t const len = pio_usb_ll_get_transaction_len(ep);
+    bits = PIO_USB_TRANSACTION_BITS(len);
+    ep->actual_len += len;
+    sim->bytes[idx] += len;
+    ep->data_id ^= 1;
+    if (ep->actual_len >= ep->total_len) {
+      // application resubmits right away
+      ep->has_transfer = false;
+      sim->active &= ~(1u << idx);
+      sim_transfer_start(sim, idx);
+    }
+  } else {
+    // token, NAK and a turnaround
+    bits = 32 + 16 + 2 * 3 + 18;
+  }
+
+  sim->now_us += bits / 12.0 + PIO_USB_TRANSACTION_OVERHEAD_US;
+}
+
+static uint32_t sim_elapsed_us(void *ctx) {
+  return (uint32_t)((sim_t *)ctx)->now_us;
+}
+
+static void sim_budget_transaction(void *ctx, endpoint_t *ep) {
+  sim_t *sim = ctx;
+  sim_transaction(sim, ep - sim->ep);
+}
+
+static void sim_frame(sim_t *sim, bool budget, uint8_t *rr_ep_idx) {
+  sim->now_us = (32 + 3) / 12.0 + PIO_USB_TRANSACTION_OVERHEAD_US; // SOF
+
+  // first pass, pool order
+  uint32_t active = sim->active;
+  while (active) {
+    sim_transaction(sim, pio_usb_ll_pop_ep(&active));
+  }
+
+  if (budget) {
+    pio_usb_ll_budget_round_robin(sim->ep, &sim->active, rr_ep_idx, true,
+                                  BUDGET_US, sim_elapsed_us,
+                                  sim_budget_transaction, sim);
+  }
+
+  if (sim->now_us > sim->max_frame_us) {
+    sim->max_frame_us = sim->now_us;
+  }
+}
+
+static void sim_run(sim_t *sim, int ep_cnt, int ready_percent, bool budget) {
+  uint8_t rr_ep_idx = 0;
+
+  memset(sim, 0, sizeof(*sim));
+  sim->ep_cnt = ep_cnt;
+  sim->ready_percent = ready_percent;
+  for (int i = 0; i < ep_cnt; i++) {
+    sim->ep[i].size = 64;
+    sim->ep[i].attr = EP_ATTR_BULK;
+    sim->ep[i].ep_num = 0x81 + i;
+    sim_transfer_start(sim, i);
+  }
+
+  srand(1);
+  for (int f = 0; f < FRAME_CNT; f++) {
+    sim_frame(sim, budget, &rr_ep_idx);
+  }
+}
+
+int main(void) {
+  static const int ep_cnts[] = {1, 2, 4};
+  static const int ready_percents[] = {100, 50};
+  int fail = 0;
+
+  printf("%-4s %-6s %12s %12s %7s %10s\n", "eps", "ready", "1/frame KB/s",
+         "budget KB/s", "gain", "fairness");
+
+  for (size_t e = 0; e < sizeof(ep_cnts) / sizeof(ep_cnts[0]); e++) {
+    for (size_t r = 0; r < sizeof(ready_percents) / sizeof(ready_percents[0]);
+         r++) {
+      sim_t sim;
+      uint32_t base_total = 0;
+      uint32_t total = 0;
+      uint32_t min_bytes = UINT32_MAX;
+      uint32_t max_bytes = 0;
+
+      sim_run(&sim, ep_cnts[e], ready_percents[r], false);
+      for (int i = 0; i < sim.ep_cnt; i++) {
+        base_total += sim.bytes[i];
+      }
+
+      sim_run(&sim, ep_cnts[e], ready_percents[r], true);
+      for (int i = 0; i < sim.ep_cnt; i++) {
+        total += sim.bytes[i];
+        min_bytes = sim.bytes[i] < min_bytes ? sim.bytes[i] : min_bytes;
+        max_bytes = sim.bytes[i] > max_bytes ? sim.bytes[i] : max_bytes;
+      }
+
+      // bytes per FRAME_CNT ms is KB/s
+      printf("%-4d %5d%% %12.1f %12.1f %6.1fx %9.2f\n", ep_cnts[e],
+             ready_percents[r], base_total / 1000.0 * 1000 / FRAME_CNT,
+             total / 1000.0 * 1000 / FRAME_CNT, (double)total / base_total,
+             (double)min_bytes / max_bytes);
+
+      if (total <= base_total) {
+        printf("[NG] no gain\n");
+        fail = 1;
+      }
+      if (sim.max_frame_us > FRAME_US) {
+        printf("[NG] frame overrun %.1fus\n", sim.max_frame_us);
+        fail = 1;
+      }
+      if ((double)min_bytes / max_bytes < 0.9) {
+        printf("[NG] unfair round robin\n");
+        fail = 1;
+      }
+    }
+  }
+
+  printf("bulk frame budget: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
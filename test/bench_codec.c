@@ -0,0 +1,307 @@
+// Micro benchmarks of the codec: NRZI encoder, CRC16, CRC5 and the CRC16
+// tracking of the receive loop, for packet sizes 0-64 with data patterns
+// from no bit stuffing to worst case bit stuffing.
+//
+// bench_codec [-w file] [-b file] [-t percent]
+//   -w: write results to file to be used as baseline later
+//   -b: fail if any function is slower than the baseline by more than -t,
+//       summed over all patterns and sizes to even out timing noise
+//   -t: allowed slowdown in percent, default 20
+//
+// Results are cycles on x86 hosts (TSC) and nanoseconds elsewhere, so a
+// baseline is only meaningful on the machine that wrote it.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "pio_usb_ll.h"
+#include "usb_crc.h"
+
+#define DATA_MAX 64
+#define ENCODED_MAX ((DATA_MAX + 4) * 2 * 7 / 6 + 8)
+#define RESULT_MAX 128
+#define REPEAT 15
+
+typedef struct {
+  char name[64];
+  double ticks;
+} result_t;
+
+static result_t results[RESULT_MAX];
+static int result_cnt;
+
+static uint8_t encoded[ENCODED_MAX];
+static volatile uint32_t sink;
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_UNIT "cycles"
+static inline uint64_t ticks(void) { return __rdtsc(); }
+#else
+#define TICK_UNIT "ns"
+static inline uint64_t ticks(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#endif
+
+typedef uint32_t (*bench_func_t)(uint8_t const *data, uint16_t len);
+
+static __attribute__((noinline)) uint32_t run_encode_tx_data(
+    uint8_t const *data, uint16_t len) {
+  return pio_usb_ll_encode_tx_data(data, len, encoded);
+}
+
+static __attribute__((noinline)) uint32_t run_encode_tx_packet(
+    uint8_t const *data, uint16_t len) {
+  return pio_usb_ll_encode_tx_packet(USB_PID_DATA0, data, len, encoded);
+}
+
+static __attribute__((noinline)) uint32_t run_crc16(uint8_t const *data,
+                                                    uint16_t len) {
+  return calc_usb_crc16(data, len);
+}
+
+// Same per byte work as pio_usb_bus_receive_packet_and_handshake(), data
+// must be followed by its CRC16
+static __attribute__((noinline)) uint32_t run_rx_crc16(uint8_t const *data,
+                                                       uint16_t len) {
+  uint16_t crc = 0xffff;
+
+  for (int idx = 0; idx < len + 2; idx++) {
+    crc = update_usb_crc16(crc, data[idx]);
+  }
+
+  return crc == USB_CRC16_RESIDUE;
+}
+
+// Ticks of one call, minimum of REPEAT runs to filter out interruptions
+static double measure(bench_func_t func, uint8_t const *data, uint16_t len,
+                      int loop) {
+  double best = 0;
+
+  for (int r = 0; r < REPEAT; r++) {
+    uint64_t const start = ticks();
+    for (int i = 0; i < loop; i++) {
+      sink += func(data, len);
+    }
+    double const t = (double)(ticks() - start) / loop;
+    if (r == 0 || t < best) {
+      best = t;
+    }
+  }
+
+  return best;
+}
+
+static double measure_crc5(uint8_t (*func)(uint16_t)) {
+  double best = 0;
+
+  for (int r = 0; r < REPEAT; r++) {
+    uint64_t const start = ticks();
+    for (int i = 0; i < 100; i++) {
+      for (uint16_t v = 0; v < 0x800; v++) {
+        sink += func(v);
+      }
+    }
+    double const t = (double)(ticks() - start) / (100 * 0x800);
+    if (r == 0 || t < best) {
+      best = t;
+    }
+  }
+
+  return best;
+}
+
+static void add_result(char const *name, double t, int len) {
+  if (result_cnt < RESULT_MAX) {
+    snprintf(results[result_cnt].name, sizeof(results[0].name), "%s", name);
+    results[result_cnt].ticks = t;
+    result_cnt++;
+  }
+
+  if (len > 0) {
+    printf("%-28s %10.1f %8.2f\n", name, t, t / len);
+  } else {
+    printf("%-28s %10.1f %8s\n", name, t, "-");
+  }
+}
+
+static double lookup_baseline(result_t const *base, int base_cnt,
+                              char const *name) {
+  for (int i = 0; i < base_cnt; i++) {
+    if (strcmp(base[i].name, name) == 0) {
+      return base[i].ticks;
+    }
+  }
+  return 0;
+}
+
+static int compare_baseline(char const *path, double threshold) {
+  static result_t base[RESULT_MAX];
+  int base_cnt = 0;
+  int fail = 0;
+  FILE *fp = fopen(path, "r");
+
+  if (fp == NULL) {
+    printf("[NG] cannot open baseline %s\n", path);
+    return 1;
+  }
+  while (base_cnt < RESULT_MAX &&
+         fscanf(fp, "%63s %lf", base[base_cnt].name, &base[base_cnt].ticks) ==
+             2) {
+    base_cnt++;
+  }
+  fclose(fp);
+
+  // group results by function name, the part before the first '/'
+  for (int i = 0; i < result_cnt; i++) {
+    size_t const func_len = strcspn(results[i].name, "/");
+    bool first = true;
+    for (int j = 0; j < i; j++) {
+      if (strncmp(results[j].name, results[i].name, func_len) == 0 &&
+          strcspn(results[j].name, "/") == func_len) {
+        first = false;
+        break;
+      }
+    }
+    if (!first) {
+      continue;
+    }
+
+    double total = 0;
+    double total_base = 0;
+    for (int j = i; j < result_cnt; j++) {
+      if (strncmp(results[j].name, results[i].name, func_len) != 0 ||
+          strcspn(results[j].name, "/") != func_len) {
+        continue;
+      }
+      double const b = lookup_baseline(base, base_cnt, results[j].name);
+      if (b > 0) {
+        total += results[j].ticks;
+        total_base += b;
+      }
+    }
+    if (total_base > 0 && total > total_base * (1.0 + threshold / 100)) {
+      printf("[NG] %.*s: %.1f %s, baseline %.1f (+%.0f%%)\n", (int)func_len,
+             results[i].name, total, TICK_UNIT, total_base,
+             (total / total_base - 1.0) * 100);
+      fail = 1;
+    }
+  }
+  printf("regression (threshold %.0f%%): %s\n", threshold,
+         fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
+
+static int write_baseline(char const *path) {
+  FILE *fp = fopen(path, "w");
+
+  if (fp == NULL) {
+    printf("[NG] cannot write baseline %s\n", path);
+    return 1;
+  }
+  for (int i = 0; i < result_cnt; i++) {
+    fprintf(fp, "%s %.1f\n", results[i].name, results[i].ticks);
+  }
+  fclose(fp);
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  char const *baseline = NULL;
+  char const *output = NULL;
+  double threshold = 20;
+  int opt;
+  int fail = 0;
+
+  while ((opt = getopt(argc, argv, "b:t:w:")) != -1) {
+    switch (opt) {
+      case 'b':
+        baseline = optarg;
+        break;
+      case 't':
+        threshold = atof(optarg);
+        break;
+      case 'w':
+        output = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-w file] [-b file] [-t percent]\n",
+                argv[0]);
+        return 2;
+    }
+  }
+
+  pio_usb_ll_encode_tx_init(false);
+
+  static const struct {
+    char const *name;
+    bench_func_t func;
+  } funcs[] = {
+      {"encode_tx_data", run_encode_tx_data},
+      {"encode_tx_packet", run_encode_tx_packet},
+      {"crc16", run_crc16},
+      {"rx_crc16", run_rx_crc16},
+  };
+  // zero: no bit stuffing, ones: stuffed bit every 6 bits
+  static char const *const patterns[] = {"zero", "random", "ones"};
+  static const uint16_t sizes[] = {0, 1, 8, 16, 32, 64};
+  uint8_t data[DATA_MAX + 2];
+
+  printf("%-28s %10s %8s\n", "function/pattern/bytes", TICK_UNIT, "/byte");
+
+  for (size_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++) {
+    srand(1);
+    for (int i = 0; i < DATA_MAX; i++) {
+      data[i] = p == 0 ? 0x00 : p == 2 ? 0xff : rand();
+    }
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      uint16_t const len = sizes[s];
+      uint16_t const crc = calc_usb_crc16(data, len);
+      uint8_t const saved[2] = {data[len], data[len + 1]};
+      data[len] = crc & 0xff;
+      data[len + 1] = crc >> 8;
+
+      if (!run_rx_crc16(data, len)) {
+        printf("[NG] rx_crc16 mismatch %s/%u\n", patterns[p], len);
+        fail = 1;
+      }
+
+      for (size_t f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s/%s/%u", funcs[f].name, patterns[p],
+                 len);
+        add_result(name, measure(funcs[f].func, data, len, 20000), len);
+      }
+
+      data[len] = saved[0];
+      data[len + 1] = saved[1];
+    }
+  }
+
+  // Token and SOF CRC5 over the whole 11bit range
+  add_result("crc5", measure_crc5(calc_usb_crc5), 0);
+  add_result("crc5_token_byte", measure_crc5(usb_crc5_token_byte), 0);
+
+  if (output) {
+    fail |= write_baseline(output);
+  }
+  if (baseline) {
+    fail |= compare_baseline(baseline, threshold);
+  }
+
+  return fail;
+}
@@ -0,0 +1,445 @@
+// Compare table driven pio_usb_ll_encode_tx_data with the former bit-by-bit
+// encoder, fused pio_usb_ll_encode_tx_packet with the former
+// copy + CRC16 + encode passes and pio_usb_ll_encode_sof with the former SOF
+// construction, pio_usb_ll_encode_token with the former token construction
+// and the prebuilt pio_usb_const_packet table. Output must be identical; the
+// speed ratio is printed. Isochronous size packets are decoded back instead,
+// the former encoder is limited to 255 encoded bytes.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pio_usb_ll.h"
+#include "usb_crc.h"
+
+// Former implementation, kept as reference
+static uint8_t legacy_encode_tx_data(uint8_t const *buffer, uint8_t buffer_len,
+                                     uint8_t *encoded_data) {
+  uint16_t bit_idx = 0;
+  int current_state = 1;
+  int bit_stuffing = 6;
+  for (int idx = 0; idx < buffer_len; idx++) {
+    uint8_t byte = buffer[idx];
+    for (int b = 0; b < 8; b++) {
+      uint16_t byte_idx = bit_idx >> 2;
+      encoded_data[byte_idx] <<= 2;
+      if (byte & (1 << b)) {
+        if (current_state) {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+        } else {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+        }
+        bit_stuffing--;
+      } else {
+        if (current_state) {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+          current_state = 0;
+        } else {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+          current_state = 1;
+        }
+        bit_stuffing = 6;
+      }
+
+      bit_idx++;
+
+      if (bit_stuffing == 0) {
+        byte_idx = bit_idx >> 2;
+        encoded_data[byte_idx] <<= 2;
+
+        if (current_state) {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_J;
+          current_state = 0;
+        } else {
+          encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+          current_state = 1;
+        }
+        bit_stuffing = 6;
+        bit_idx++;
+      }
+    }
+  }
+
+  uint16_t byte_idx = bit_idx >> 2;
+  encoded_data[byte_idx] <<= 2;
+  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_SE0;
+  bit_idx++;
+
+  byte_idx = bit_idx >> 2;
+  encoded_data[byte_idx] <<= 2;
+  encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_COMP;
+  bit_idx++;
+
+  // terminate buffers with K
+  do {
+    byte_idx = bit_idx >> 2;
+    encoded_data[byte_idx] <<= 2;
+    encoded_data[byte_idx] |= PIO_USB_TX_ENCODED_DATA_K;
+    bit_idx++;
+  } while (bit_idx & 0x03);
+
+  byte_idx = bit_idx >> 2;
+  return byte_idx;
+}
+
+// longest packet whose encoded length still fits in uint8_t
+#define DATA_MAX 100
+#define ENCODED_MAX (DATA_MAX * 2 * 7 / 6 + 4)
+
+static int check(const uint8_t *data, uint8_t len) {
+  uint8_t expect[ENCODED_MAX];
+  uint8_t actual[ENCODED_MAX];
+  memset(expect, 0x55, sizeof(expect));
+  memset(actual, 0xaa, sizeof(actual));
+
+  uint8_t expect_len = legacy_encode_tx_data(data, len, expect);
+  uint8_t actual_len = pio_usb_ll_encode_tx_data(data, len, actual);
+
+  if (expect_len != actual_len || memcmp(expect, actual, expect_len) != 0) {
+    printf("[NG] mismatch at len %u\n", len);
+    return 1;
+  }
+  return 0;
+}
+
+// Former prepare_tx_data(), kept as reference
+static uint16_t legacy_encode_tx_packet(uint8_t pid, uint8_t const *data,
+                                        uint16_t len, uint8_t *encoded_data) {
+  uint8_t buffer[DATA_MAX + 4];
+  buffer[0] = USB_SYNC;
+  buffer[1] = pid;
+  memcpy(buffer + 2, data, len);
+
+  uint16_t const crc16 = calc_usb_crc16(data, len);
+  buffer[2 + len] = crc16 & 0xff;
+  buffer[2 + len + 1] = crc16 >> 8;
+
+  return legacy_encode_tx_data(buffer, len + 4, encoded_data);
+}
+
+static int check_packet(uint8_t pid, const uint8_t *data, uint16_t len) {
+  uint8_t expect[ENCODED_MAX];
+  uint8_t actual[ENCODED_MAX];
+  memset(expect, 0x55, sizeof(expect));
+  memset(actual, 0xaa, sizeof(actual));
+
+  uint8_t expect_len = legacy_encode_tx_packet(pid, data, len, expect);
+  uint8_t actual_len = pio_usb_ll_encode_tx_packet(pid, data, len, actual);
+
+  if (expect_len != actual_len || memcmp(expect, actual, expect_len) != 0) {
+    printf("[NG] packet mismatch at len %u\n", len);
+    return 1;
+  }
+  return 0;
+}
+
+#define ISO_DATA_MAX 1023
+#define ISO_ENCODED_MAX ((ISO_DATA_MAX + 4) * 2 * 7 / 6 + 8)
+
+// NRZI decode 2bit symbols up to SE0, dropping stuffed bits. The line is
+// taken as K before SYNC, as the encoder does.
+static int decode_symbols(const uint8_t *encoded, int encoded_len,
+                          uint8_t *decoded) {
+  uint8_t prev = PIO_USB_TX_ENCODED_DATA_K;
+  int ones = 0;
+  int bits = 0;
+
+  for (int i = 0; i < encoded_len * 4; i++) {
+    uint8_t const sym = (encoded[i / 4] >> (6 - 2 * (i % 4))) & 0x03;
+    if (sym == PIO_USB_TX_ENCODED_DATA_SE0) {
+      return (bits % 8) ? -1 : bits / 8;
+    }
+    bool const one = (sym == prev);
+    prev = sym;
+    if (ones == 6) {
+      ones = 0; // stuffed bit
+      if (one) {
+        return -1;
+      }
+      continue;
+    }
+    ones = one ? ones + 1 : 0;
+    decoded[bits / 8] = (decoded[bits / 8] >> 1) | (one ? 0x80 : 0);
+    bits++;
+  }
+
+  return -1;
+}
+
+static int check_iso_packet(const uint8_t *data, uint16_t len) {
+  static uint8_t encoded[ISO_ENCODED_MAX];
+  static uint8_t decoded[ISO_ENCODED_MAX];
+
+  uint16_t const encoded_len =
+      pio_usb_ll_encode_tx_packet(USB_PID_DATA0, data, len, encoded);
+  int const decoded_len = decode_symbols(encoded, encoded_len, decoded);
+  uint16_t const crc = calc_usb_crc16(data, len);
+
+  if (decoded_len != len + 4 || decoded[0] != USB_SYNC ||
+      decoded[1] != USB_PID_DATA0 || memcmp(decoded + 2, data, len) != 0 ||
+      decoded[len + 2] != (crc & 0xff) || decoded[len + 3] != (crc >> 8)) {
+    printf("[NG] isochronous packet mismatch at len %u\n", len);
+    return 1;
+  }
+  return 0;
+}
+
+// Former SOF construction in pio_usb_host_frame(), kept as reference
+static uint8_t legacy_encode_sof(uint16_t frame_number, uint8_t *encoded_data) {
+  uint8_t sof_packet[4] = {USB_SYNC, USB_PID_SOF, 0x00, 0x10};
+  sof_packet[2] = frame_number & 0xff;
+  sof_packet[3] = (calc_usb_crc5(frame_number) << 3) | (frame_number >> 8);
+  return legacy_encode_tx_data(sof_packet, sizeof(sof_packet), encoded_data);
+}
+
+static int check_sof(void) {
+  for (uint16_t frame = 0; frame < 0x800; frame++) {
+    uint8_t expect[16];
+    uint8_t actual[16];
+    memset(expect, 0x55, sizeof(expect));
+    memset(actual, 0xaa, sizeof(actual));
+
+    uint8_t expect_len = legacy_encode_sof(frame, expect);
+    uint8_t actual_len = pio_usb_ll_encode_sof(frame, actual);
+
+    if (expect_len != actual_len || memcmp(expect, actual, expect_len) != 0) {
+      printf("[NG] SOF mismatch at frame %u\n", frame);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Former pio_usb_bus_send_token() encoding, kept as reference
+static uint8_t legacy_encode_token(uint8_t token, uint8_t addr, uint8_t ep_num,
+                                   uint8_t *encoded_data) {
+  uint8_t packet[4] = {USB_SYNC, token, 0, 0};
+  uint16_t dat = ((uint16_t)(ep_num & 0xf) << 7) | (addr & 0x7f);
+  uint8_t crc = calc_usb_crc5(dat);
+  packet[2] = dat & 0xff;
+  packet[3] = (crc << 3) | ((dat >> 8) & 0x1f);
+  return legacy_encode_tx_data(packet, sizeof(packet), encoded_data);
+}
+
+static int check_token(void) {
+  static const uint8_t pids[] = {USB_PID_IN, USB_PID_OUT, USB_PID_SETUP};
+  for (size_t p = 0; p < sizeof(pids); p++) {
+    for (int addr = 0; addr < 128; addr++) {
+      for (int ep = 0; ep < 256; ep++) {
+        uint8_t expect[16];
+        uint8_t actual[16];
+        memset(expect, 0x55, sizeof(expect));
+        memset(actual, 0xaa, sizeof(actual));
+
+        uint8_t expect_len = legacy_encode_token(pids[p], addr, ep, expect);
+        uint8_t actual_len = pio_usb_ll_encode_token(pids[p], addr, ep, actual);
+
+        if (expect_len != actual_len ||
+            memcmp(expect, actual, expect_len) != 0) {
+          printf("[NG] token mismatch at %02x %d %02x\n", pids[p], addr, ep);
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+static int check_const_packet(void) {
+  static const uint8_t pids[PIO_USB_PACKET_CNT] = {
+      [PIO_USB_PACKET_ACK] = USB_PID_ACK,
+      [PIO_USB_PACKET_NAK] = USB_PID_NAK,
+      [PIO_USB_PACKET_STALL] = USB_PID_STALL,
+      [PIO_USB_PACKET_PRE] = USB_PID_PRE,
+      [PIO_USB_PACKET_DATA0_ZLP] = USB_PID_DATA0,
+      [PIO_USB_PACKET_DATA1_ZLP] = USB_PID_DATA1,
+  };
+  for (int id = 0; id < PIO_USB_PACKET_CNT; id++) {
+    const pio_usb_const_packet_t *packet = &pio_usb_const_packet[id];
+    uint8_t expect[16];
+    uint8_t expect_len;
+    memset(expect, 0x55, sizeof(expect));
+
+    if (id >= PIO_USB_PACKET_DATA0_ZLP) {
+      expect_len = legacy_encode_tx_packet(pids[id], NULL, 0, expect);
+    } else {
+      uint8_t raw[2] = {USB_SYNC, pids[id]};
+      expect_len = legacy_encode_tx_data(raw, sizeof(raw), expect);
+    }
+
+    // compare including K padding up to word boundary
+    if (expect_len != packet->len ||
+        memcmp(expect, packet->encoded, (expect_len + 3) & ~3) != 0) {
+      printf("[NG] constant packet %d mismatch\n", id);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+typedef uint8_t (*encode_func_t)(uint8_t const *, uint8_t, uint8_t *);
+
+static double bench(encode_func_t func, const uint8_t *data, uint8_t len,
+                    int loop) {
+  static uint8_t encoded[ENCODED_MAX];
+  volatile uint8_t sink = 0;
+  double start = now_ns();
+  for (int i = 0; i < loop; i++) {
+    sink += func(data, len, encoded);
+  }
+  (void)sink;
+  return (now_ns() - start) / loop;
+}
+
+typedef uint16_t (*encode_packet_func_t)(uint8_t, uint8_t const *, uint16_t,
+                                        uint8_t *);
+
+static double bench_packet(encode_packet_func_t func, const uint8_t *data,
+                           uint16_t len, int loop) {
+  static uint8_t encoded[ENCODED_MAX];
+  volatile uint8_t sink = 0;
+  double start = now_ns();
+  for (int i = 0; i < loop; i++) {
+    sink += func(USB_PID_DATA0, data, len, encoded);
+  }
+  (void)sink;
+  return (now_ns() - start) / loop;
+}
+
+int main(void) {
+  int fail = 0;
+  uint8_t data[DATA_MAX];
+
+  pio_usb_ll_encode_tx_init(false);
+
+  // exhaustive pairs of bytes cover every run length entering a byte
+  for (int a = 0; a < 256; a++) {
+    for (int b = 0; b < 256; b++) {
+      uint8_t pair[3] = {(uint8_t)a, (uint8_t)b, (uint8_t)(a ^ b)};
+      fail |= check(pair, sizeof(pair));
+    }
+  }
+
+  srand(1);
+  for (int i = 0; i < 100000; i++) {
+    uint8_t len = rand() % sizeof(data);
+    for (int j = 0; j < len; j++) {
+      // bias towards 0xff to exercise bit stuffing
+      data[j] = (rand() & 1) ? 0xff : rand();
+    }
+    fail |= check(data, len);
+  }
+
+  memset(data, 0xff, sizeof(data));
+  for (int len = 0; len <= DATA_MAX; len++) {
+    fail |= check(data, len);
+  }
+
+  printf("encode: %s\n", fail ? "[NG]" : "[OK]");
+
+  int packet_fail = 0;
+  for (int i = 0; i < 100000; i++) {
+    uint8_t len = rand() % (DATA_MAX - 4 + 1);
+    for (int j = 0; j < len; j++) {
+      data[j] = (rand() & 1) ? 0xff : rand();
+    }
+    uint8_t pid = (rand() & 1) ? USB_PID_DATA1 : USB_PID_DATA0;
+    packet_fail |= check_packet(pid, data, len);
+  }
+  printf("encode packet: %s\n", packet_fail ? "[NG]" : "[OK]");
+  fail |= packet_fail;
+
+  static uint8_t iso_data[ISO_DATA_MAX];
+  int iso_fail = 0;
+  for (int i = 0; i < 2000 && !iso_fail; i++) {
+    uint16_t const len = (i < 3) ? (uint16_t[]){0, 64, ISO_DATA_MAX}[i]
+                                 : rand() % (ISO_DATA_MAX + 1);
+    for (int j = 0; j < len; j++) {
+      iso_data[j] = (rand() & 1) ? 0xff : rand();
+    }
+    iso_fail |= check_iso_packet(iso_data, len);
+  }
+  memset(iso_data, 0xff, sizeof(iso_data));
+  iso_fail |= check_iso_packet(iso_data, ISO_DATA_MAX);
+  printf("encode isochronous packet: %s\n", iso_fail ? "[NG]" : "[OK]");
+  fail |= iso_fail;
+
+  int const sof_fail = check_sof();
+  printf("encode SOF: %s\n", sof_fail ? "[NG]" : "[OK]");
+  fail |= sof_fail;
+
+  int const token_fail = check_token();
+  printf("encode token: %s\n", token_fail ? "[NG]" : "[OK]");
+  fail |= token_fail;
+
+  int const const_fail = check_const_packet();
+  printf("constant packet: %s\n", const_fail ? "[NG]" : "[OK]");
+  fail |= const_fail;
+
+  // 32bit TX DMA: same stream padded with K up to word boundary
+  pio_usb_ll_encode_tx_init(true);
+  int word_fail = 0;
+  for (int i = 0; i < 100000; i++) {
+    uint8_t expect[ENCODED_MAX];
+    uint8_t actual[ENCODED_MAX];
+    uint8_t len = rand() % (DATA_MAX - 4 + 1);
+    for (int j = 0; j < len; j++) {
+      data[j] = (rand() & 1) ? 0xff : rand();
+    }
+    uint8_t expect_len = legacy_encode_tx_packet(USB_PID_DATA1, data, len,
+                                                 expect);
+    while (expect_len & 0x03) {
+      expect[expect_len++] = 0x55;
+    }
+    uint8_t actual_len = pio_usb_ll_encode_tx_packet(USB_PID_DATA1, data, len,
+                                                     actual);
+    if (expect_len != actual_len || memcmp(expect, actual, expect_len) != 0) {
+      printf("[NG] word aligned mismatch at len %u\n", len);
+      word_fail = 1;
+      break;
+    }
+  }
+  printf("encode word aligned: %s\n", word_fail ? "[NG]" : "[OK]");
+  fail |= word_fail;
+  pio_usb_ll_encode_tx_init(false);
+
+  for (int j = 0; j < 64; j++) {
+    data[j] = j;
+  }
+  int const loop = 200000;
+  double legacy = bench(legacy_encode_tx_data, data, 64, loop);
+  double table = bench(pio_usb_ll_encode_tx_data, data, 64, loop);
+  printf("64bytes packet: legacy %.1f ns, table %.1f ns, x%.2f\n", legacy,
+         table, legacy / table);
+
+  legacy = bench_packet(legacy_encode_tx_packet, data, 64, loop);
+  table = bench_packet(pio_usb_ll_encode_tx_packet, data, 64, loop);
+  printf("64bytes DATA packet: legacy %.1f ns, fused %.1f ns, x%.2f\n",
+         legacy, table, legacy / table);
+
+  static uint8_t sof_encoded[16];
+  volatile uint8_t sink = 0;
+  double start = now_ns();
+  for (int i = 0; i < loop; i++) {
+    sink += legacy_encode_sof(i & 0x7ff, sof_encoded);
+  }
+  legacy = (now_ns() - start) / loop;
+  start = now_ns();
+  for (int i = 0; i < loop; i++) {
+    sink += pio_usb_ll_encode_sof(i & 0x7ff, sof_encoded);
+  }
+  table = (now_ns() - start) / loop;
+  printf("SOF packet: legacy %.1f ns, prefixed %.1f ns, x%.2f\n", legacy,
+         table, legacy / table);
+
+  return fail;
+}
@@ -0,0 +1,30 @@
+// Minimal stand-in of pico-sdk headers to build codec sources on host
+
+#pragma once
+
+#include "pico/stdlib.h"
+
+typedef struct pio_hw pio_hw_t;
+typedef pio_hw_t *PIO;
+
+typedef struct {
+  const uint16_t *instructions;
+  uint8_t length;
+  int8_t origin;
+} pio_program_t;
+
+static inline bool gpio_get(uint gpio) {
+  (void)gpio;
+  return false;
+}
+
+static inline void pio_sm_restart(PIO pio, uint sm) {
+  (void)pio;
+  (void)sm;
+}
+
+static inline void pio_sm_exec(PIO pio, uint sm, uint instr) {
+  (void)pio;
+  (void)sm;
+  (void)instr;
+}
@@ -0,0 +1,20 @@
+// Minimal stand-in of pico-sdk headers to build codec sources on host
+
+#pragma once
+
+#include "pico/stdlib.h"
+
+static inline void __dmb(void) { __atomic_thread_fence(__ATOMIC_SEQ_CST); }
+
+typedef volatile uint32_t spin_lock_t;
+
+static inline uint32_t spin_lock_blocking(spin_lock_t *lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+  }
+  return 0;
+}
+
+static inline void spin_unlock(spin_lock_t *lock, uint32_t saved) {
+  (void)saved;
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,21 @@
+// Minimal stand-in of pico-sdk headers to build codec sources on host
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+#define __not_in_flash(group)
+#define __not_in_flash_func(func_name) func_name
+#define __no_inline_not_in_flash_func(func_name) \
+  __attribute__((noinline)) func_name
+#define __time_critical_func(func_name) func_name
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+#define __force_inline __always_inline
+#define __unused __attribute__((unused))
@@ -0,0 +1,103 @@
+// Completion ring of root_port_t with the producer and the consumer on two
+// threads, like the frame ISR and the task on the two RP2040 cores. The
+// producer retries a dropped record so that every record must arrive once,
+// in order and intact.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "pio_usb_ll.h"
+
+#define RECORD_CNT 500000
+
+static root_port_t root;
+static volatile bool producer_done;
+
+// fields are derived from the sequence number to detect torn records
+static void make_record(uint32_t seq, pio_usb_completion_t *rec) {
+  rec->ep_idx = seq % PIO_USB_EP_POOL_CNT;
+  rec->flag = PIO_USB_INTS_ENDPOINT_COMPLETE_BITS;
+  rec->actual_len = (seq * 7) & 0xffff;
+  rec->frame = seq;
+}
+
+static void *producer(void *arg) {
+  (void)arg;
+  for (uint32_t seq = 0; seq < RECORD_CNT; seq++) {
+    pio_usb_completion_t rec;
+    make_record(seq, &rec);
+    while (!pio_usb_ll_completion_push(&root, &rec)) {
+      sched_yield();
+    }
+  }
+  producer_done = true;
+  return NULL;
+}
+
+int main(void) {
+  pthread_t thread;
+  uint32_t received = 0;
+  int fail = 0;
+
+  // one record more than the ring holds is dropped
+  for (uint32_t seq = 0; seq <= PIO_USB_COMPLETION_RING_CNT; seq++) {
+    pio_usb_completion_t rec;
+    make_record(seq, &rec);
+    bool const pushed = pio_usb_ll_completion_push(&root, &rec);
+    if (pushed != (seq < PIO_USB_COMPLETION_RING_CNT)) {
+      printf("[NG] push %u of %u returned %d\n", seq,
+             PIO_USB_COMPLETION_RING_CNT, pushed);
+      fail = 1;
+    }
+  }
+  pio_usb_completion_t recs[PIO_USB_COMPLETION_RING_CNT];
+  if (pio_usb_ll_completion_pop(&root, recs, PIO_USB_COMPLETION_RING_CNT) !=
+          PIO_USB_COMPLETION_RING_CNT ||
+      root.completion_drop_cnt != 1 ||
+      pio_usb_ll_completion_pop(&root, recs, 1) != 0) {
+    printf("[NG] full ring\n");
+    fail = 1;
+  }
+  root.completion_drop_cnt = 0;
+
+  pthread_create(&thread, NULL, producer, NULL);
+
+  while (true) {
+    bool const done = producer_done;
+    // batches of a few records
+    uint8_t const cnt = pio_usb_ll_completion_pop(&root, recs, 1 + rand() % 8);
+    for (uint8_t i = 0; i < cnt; i++) {
+      pio_usb_completion_t expect;
+      make_record(recs[i].frame, &expect);
+      if (recs[i].frame != received ||
+          recs[i].ep_idx != expect.ep_idx || recs[i].flag != expect.flag ||
+          recs[i].actual_len != expect.actual_len) {
+        printf("[NG] record %u, expected %u\n", recs[i].frame, received);
+        fail = 1;
+      }
+      received++;
+    }
+    if (cnt == 0) {
+      if (done) {
+        break;
+      }
+      sched_yield();
+    }
+  }
+
+  pthread_join(thread, NULL);
+
+  printf("received %u, dropped %u\n", received, root.completion_drop_cnt);
+  if (received != RECORD_CNT) {
+    printf("[NG] records lost\n");
+    fail = 1;
+  }
+
+  printf("completion ring: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,64 @@
+// Compare calc_usb_crc16 and update_usb_crc16_word with a bitwise CRC16-USB
+// for every length up to 1023 bytes and every start alignment. Built once
+// per PIO_USB_CRC16_SLICE.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "usb_crc.h"
+
+static uint16_t bitwise_crc16(const uint8_t *data, uint16_t len) {
+  uint16_t crc = 0xffff;
+
+  for (int idx = 0; idx < len; idx++) {
+    crc ^= data[idx];
+    for (int b = 0; b < 8; b++) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : crc >> 1;
+    }
+  }
+
+  return crc ^ 0xffff;
+}
+
+int main(void) {
+  static uint8_t data[1024 + 8];
+  int fail = 0;
+
+  srand(1);
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = rand();
+  }
+
+  for (int offset = 0; offset < 8 && !fail; offset++) {
+    for (int len = 0; len <= 1023; len++) {
+      uint16_t const expect = bitwise_crc16(&data[offset], len);
+      uint16_t const actual = calc_usb_crc16(&data[offset], len);
+
+      // words as the RX decoder pushes them, first byte in LSB
+      uint8_t const *p = &data[offset];
+      uint16_t crc = 0xffff;
+      int idx = 0;
+      for (; idx + 4 <= len; idx += 4) {
+        uint32_t const w = p[idx] | (p[idx + 1] << 8) | (p[idx + 2] << 16) |
+                           ((uint32_t)p[idx + 3] << 24);
+        crc = update_usb_crc16_word(crc, w);
+      }
+      for (; idx < len; idx++) {
+        crc = update_usb_crc16(crc, p[idx]);
+      }
+      crc ^= 0xffff;
+
+      if (expect != actual || expect != crc) {
+        printf("[NG] offset %d len %d: expect %04x, actual %04x, word %04x\n",
+               offset, len, expect, actual, crc);
+        fail = 1;
+        break;
+      }
+    }
+  }
+
+  printf("crc16 slice %d: %s\n", PIO_USB_CRC16_SLICE, fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,36 @@
+// Compare usb_crc5_token_byte with a bitwise CRC5-USB for every 11bit value.
+// Built once per PIO_USB_CRC5_TABLE.
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "usb_crc.h"
+
+static uint8_t bitwise_crc5(uint16_t data) {
+  uint8_t crc = 0x1f;
+
+  for (int b = 0; b < 11; b++) {
+    crc = ((crc ^ (data >> b)) & 1) ? (crc >> 1) ^ 0x14 : crc >> 1;
+  }
+
+  return crc ^ 0x1f;
+}
+
+int main(void) {
+  int fail = 0;
+
+  for (uint16_t data = 0; data < 0x800; data++) {
+    uint8_t const expect = (bitwise_crc5(data) << 3) | (data >> 8);
+    if (calc_usb_crc5(data) != bitwise_crc5(data) ||
+        usb_crc5_token_byte(data) != expect) {
+      printf("[NG] data %03x: expect %02x, actual %02x\n", data, expect,
+             usb_crc5_token_byte(data));
+      fail = 1;
+      break;
+    }
+  }
+
+  printf("crc5 table %d: %s\n", PIO_USB_CRC5_TABLE, fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,126 @@
+// Phase assignment of interrupt endpoints in the host periodic schedule, as
+// done by pio_usb_host_endpoint_open(). Endpoints of HID devices behind a
+// hub must be spread over the frames instead of bunching in phase 0.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pio_usb_ll.h"
+
+#define EP_MAX 16
+
+typedef struct {
+  uint8_t interval; // bInterval
+  uint16_t size;
+  bool fullspeed;
+} ep_desc_t;
+
+static uint16_t load_us[PIO_USB_PERIODIC_FRAMES];
+
+static void reserve(endpoint_t const *ep, int sign) {
+  for (int frame = ep->interval_phase; frame < PIO_USB_PERIODIC_FRAMES;
+       frame += ep->interval) {
+    load_us[frame] += sign * ep->periodic_us;
+  }
+}
+
+static uint16_t peak_load(void) {
+  uint16_t peak = 0;
+  for (int frame = 0; frame < PIO_USB_PERIODIC_FRAMES; frame++) {
+    peak = load_us[frame] > peak ? load_us[frame] : peak;
+  }
+  return peak;
+}
+
+// Open all endpoints, return peak load. spread = false puts all at phase 0.
+static uint16_t open_all(endpoint_t *eps, ep_desc_t const *desc, int cnt,
+                         bool spread) {
+  memset(load_us, 0, sizeof(load_us));
+  for (int i = 0; i < cnt; i++) {
+    endpoint_t *ep = &eps[i];
+    memset(ep, 0, sizeof(*ep));
+    ep->size = desc[i].size;
+    ep->interval = pio_usb_ll_periodic_period(desc[i].interval);
+    ep->interval_phase =
+        spread ? pio_usb_ll_periodic_phase(load_us, ep->interval) : 0;
+    ep->periodic_us = pio_usb_ll_transaction_time_us(ep, desc[i].fullspeed);
+    reserve(ep, 1);
+  }
+  return peak_load();
+}
+
+int main(void) {
+  static endpoint_t eps[EP_MAX];
+  int fail = 0;
+
+  static const struct {
+    uint8_t interval;
+    uint8_t period;
+  } periods[] = {{0, 1}, {1, 1}, {2, 2}, {3, 2}, {10, 8}, {32, 32}, {255, 32}};
+  for (size_t i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+    uint8_t const period = pio_usb_ll_periodic_period(periods[i].interval);
+    if (period != periods[i].period) {
+      printf("[NG] bInterval %u: period %u, expected %u\n",
+             periods[i].interval, period, periods[i].period);
+      fail = 1;
+    }
+  }
+
+  // 8 keyboards polled every 8 frames fit one per frame
+  ep_desc_t same[8];
+  for (int i = 0; i < 8; i++) {
+    same[i] = (ep_desc_t){8, 8, true};
+  }
+  uint16_t const one = pio_usb_ll_transaction_time_us(&(endpoint_t){.size = 8},
+                                                      true);
+  uint16_t peak = open_all(eps, same, 8, true);
+  if (peak != one) {
+    printf("[NG] 8 endpoints of bInterval 8: peak %uus, expected %uus\n", peak,
+           one);
+    fail = 1;
+  }
+
+  // keyboards, mice, gamepads and a low speed device behind a hub
+  static const ep_desc_t hid[] = {
+      {10, 8, true},  {10, 8, true},  {1, 64, true},  {4, 64, true},
+      {8, 8, false},  {10, 8, false}, {2, 16, true},  {16, 64, true},
+      {4, 8, true},   {32, 8, true},  {8, 64, true},  {1, 8, true},
+  };
+  int const hid_cnt = sizeof(hid) / sizeof(hid[0]);
+  uint16_t const bunched = open_all(eps, hid, hid_cnt, false);
+  peak = open_all(eps, hid, hid_cnt, true);
+
+  uint32_t total = 0;
+  for (int frame = 0; frame < PIO_USB_PERIODIC_FRAMES; frame++) {
+    total += load_us[frame];
+  }
+  printf("periodic peak: phase 0 %uus, spread %uus, average %.1fus\n",
+         bunched, peak, (double)total / PIO_USB_PERIODIC_FRAMES);
+  if (peak >= bunched) {
+    printf("[NG] spreading does not lower peak load\n");
+    fail = 1;
+  }
+
+  for (int i = 0; i < hid_cnt; i++) {
+    if (eps[i].interval_phase >= eps[i].interval) {
+      printf("[NG] ep %d phase %u, period %u\n", i, eps[i].interval_phase,
+             eps[i].interval);
+      fail = 1;
+    }
+  }
+
+  // closing releases the reservation
+  for (int i = 0; i < hid_cnt; i++) {
+    reserve(&eps[i], -1);
+  }
+  if (peak_load() != 0) {
+    printf("[NG] load left after close\n");
+    fail = 1;
+  }
+
+  printf("periodic schedule: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,167 @@
+// Compare the CRC16 residue check at EOP in
+// pio_usb_bus_receive_packet_and_handshake() with the former per byte
+// comparison of the last two bytes against the CRC of the bytes before them.
+// Both must accept and reject the same packets.
+// Also checks that the payload written straight to the application buffer
+// excludes the CRC field and never exceeds the buffer length.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pio_usb_ll.h"
+
+#define DATA_MAX 1023
+
+// Former receive loop, kept as reference
+static bool legacy_rx_crc_match(const uint8_t *data, int len) {
+  uint16_t crc = 0xffff;
+  uint16_t crc_prev = 0xffff;
+  uint16_t crc_prev2 = 0xffff;
+  uint16_t crc_receive = 0xffff;
+  uint16_t crc_receive_inverse;
+  bool crc_match = false;
+
+  for (int idx = 0; idx < len; idx++) {
+    crc_prev2 = crc_prev;
+    crc_prev = crc;
+    crc = update_usb_crc16(crc, data[idx]);
+    crc_receive = (crc_receive >> 8) | (data[idx] << 8);
+    crc_receive_inverse = crc_receive ^ 0xffff;
+    crc_match = (crc_receive_inverse == crc_prev2);
+  }
+
+  return len >= 2 && crc_match;
+}
+
+static bool residue_rx_crc_match(const uint8_t *data, int len) {
+  uint16_t crc = 0xffff;
+
+  for (int idx = 0; idx < len; idx++) {
+    crc = update_usb_crc16(crc, data[idx]);
+  }
+
+  return len >= 2 && crc == USB_CRC16_RESIDUE;
+}
+
+// Byte path of pio_usb_bus_receive_packet_and_handshake(): index 0-1 are
+// SYNC and PID
+static int zero_copy_rx(const uint8_t *data, int len, uint8_t *buffer,
+                        uint16_t buffer_len) {
+  uint16_t crc = 0xffff;
+  uint16_t crc_field = 0;
+  uint16_t idx = 2;
+
+  for (int i = 0; i < len; i++) {
+    idx = pio_usb_ll_receive_data_byte(buffer, buffer_len, idx, data[i], &crc,
+                                       &crc_field);
+  }
+
+  return (idx >= 4 && crc == USB_CRC16_RESIDUE) ? idx - 4 : -1;
+}
+
+static int check_zero_copy(const uint8_t *packet, int len,
+                           uint16_t buffer_len) {
+  static uint8_t buffer[DATA_MAX + 16];
+  int const payload = len - 2;
+
+  memset(buffer, 0xa5, sizeof(buffer));
+  int const res = zero_copy_rx(packet, len, buffer, buffer_len);
+  int const copied = payload < buffer_len ? payload : buffer_len;
+
+  if (res != payload || memcmp(buffer, packet, copied) != 0) {
+    printf("[NG] zero copy len %d: res %d\n", payload, res);
+    return 1;
+  }
+  for (size_t i = copied; i < sizeof(buffer); i++) {
+    if (buffer[i] != 0xa5) {
+      printf("[NG] zero copy len %d buffer %u: wrote at %u\n", payload,
+             buffer_len, (unsigned)i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Packet of data followed by its CRC16
+static int make_packet(uint8_t *packet, int len) {
+  uint16_t const crc = calc_usb_crc16(packet, len);
+  packet[len] = crc & 0xff;
+  packet[len + 1] = crc >> 8;
+  return len + 2;
+}
+
+static int check(const uint8_t *packet, int len, bool expect) {
+  bool const legacy = legacy_rx_crc_match(packet, len);
+  bool const residue = residue_rx_crc_match(packet, len);
+
+  if (legacy != residue || residue != expect) {
+    printf("[NG] len %d: legacy %d, residue %d, expect %d\n", len, legacy,
+           residue, expect);
+    return 1;
+  }
+  return 0;
+}
+
+int main(void) {
+  static uint8_t packet[DATA_MAX + 2];
+  int fail = 0;
+  int accepted = 0;
+
+  srand(1);
+  for (int i = 0; i < 200000 && !fail; i++) {
+    int const len = rand() % 70;
+    int const pattern = rand() % 4;
+    for (int j = 0; j < len; j++) {
+      // random, bit stuffing heavy, zero and byte ramp data
+      packet[j] = pattern == 0   ? rand()
+                  : pattern == 1 ? ((rand() & 1) ? 0xff : rand())
+                  : pattern == 2 ? 0x00
+                                 : j;
+    }
+    int const packet_len = make_packet(packet, len);
+    fail |= check(packet, packet_len, true);
+    fail |= check_zero_copy(packet, packet_len, rand() % (len + 4));
+
+    // single bit error anywhere in data or CRC
+    int const bit = rand() % (packet_len * 8);
+    packet[bit / 8] ^= 1 << (bit % 8);
+    fail |= check(packet, packet_len, false);
+    packet[bit / 8] ^= 1 << (bit % 8);
+
+    // truncated by EOP in the middle, or trailing garbage after CRC: both
+    // implementations look only at the last two bytes, so they must agree
+    int const cut = rand() % (packet_len + 1);
+    fail |= check(packet, cut, residue_rx_crc_match(packet, cut));
+    packet[packet_len] = rand();
+    fail |= check(packet, packet_len + 1,
+                  residue_rx_crc_match(packet, packet_len + 1));
+  }
+
+  // every 16bit tail after a fixed body: exactly one is accepted
+  memset(packet, 0xff, 64);
+  for (int tail = 0; tail < 0x10000 && !fail; tail++) {
+    packet[64] = tail & 0xff;
+    packet[65] = tail >> 8;
+    bool const match = residue_rx_crc_match(packet, 66);
+    accepted += match;
+    fail |= check(packet, 66, match);
+  }
+  if (accepted != 1) {
+    printf("[NG] %d CRC16 values accepted\n", accepted);
+    fail = 1;
+  }
+
+  // maximum size packet
+  for (int j = 0; j < DATA_MAX; j++) {
+    packet[j] = rand();
+  }
+  fail |= check(packet, make_packet(packet, DATA_MAX - 2), true);
+  fail |= check_zero_copy(packet, DATA_MAX, DATA_MAX - 2);
+
+  printf("rx crc residue: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,217 @@
+// Run the NRZI decoder programs of usb_rx.pio.h in a small PIO model, one
+// DECODER_TRIGGER per bit. usb_nrzi_decoder and usb_nrzi_decoder_bs must
+// decode the same bits from valid packets, and only usb_nrzi_decoder_bs
+// raises IRQ_RX_BS_ERR when a stuffed bit is missing.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PICO_NO_HARDWARE 1
+#include "usb_rx.pio.h"
+
+#define BITS_MAX (68 * 8 * 7 / 6 + 8)
+
+typedef struct {
+  const uint16_t *instr;
+  uint8_t wrap_target;
+  uint8_t wrap;
+  uint8_t start;
+} program_t;
+
+typedef struct {
+  uint8_t bits[BITS_MAX];
+  int bit_cnt;
+  bool bs_err;
+} decoded_t;
+
+// Feed line levels to the program, pin is read by JMP PIN. Return false if
+// the program does not reach WAIT within a bit.
+static bool run_decoder(const program_t *prog, const uint8_t *levels,
+                        int level_cnt, decoded_t *out) {
+  uint32_t x = 0;
+  uint32_t y = 0;
+  uint8_t pc = prog->start;
+  int level_idx = -1;
+  int steps = 0;
+
+  memset(out, 0, sizeof(*out));
+
+  while (true) {
+    uint16_t const instr = prog->instr[pc];
+    uint8_t const arg1 = (instr >> 5) & 0x07;
+    uint8_t const arg2 = instr & 0x1f;
+    bool jump = false;
+
+    if (++steps > 16) {
+      return false;
+    }
+
+    switch (instr >> 13) {
+      case 0: { // JMP
+        bool cond = false;
+        switch (arg1) {
+          case 0: cond = true; break;
+          case 1: cond = (x == 0); break;
+          case 2: cond = (x-- != 0); break;
+          case 3: cond = (y == 0); break;
+          case 4: cond = (y-- != 0); break;
+          case 5: cond = (x != y); break;
+          case 6: cond = levels[level_idx]; break;
+          default: return false;
+        }
+        if (cond) {
+          pc = arg2;
+          jump = true;
+        }
+        break;
+      }
+      case 1: // WAIT, next trigger
+        if (++level_idx == level_cnt) {
+          return true;
+        }
+        steps = 0;
+        break;
+      case 2: // IN null or osr (all 1) by 1 bit
+        if (out->bit_cnt == BITS_MAX || (arg1 != 3 && arg1 != 7)) {
+          return false;
+        }
+        out->bits[out->bit_cnt++] = (arg1 == 7);
+        break;
+      case 5: // MOV x, !x
+        if (instr != 0xa029) {
+          return false;
+        }
+        x = ~x;
+        break;
+      case 6: // IRQ
+        if (arg2 == IRQ_RX_BS_ERR) {
+          out->bs_err = true;
+        }
+        break;
+      case 7: // SET y
+        if (arg1 != 2) {
+          return false;
+        }
+        y = arg2;
+        break;
+      default:
+        return false;
+    }
+
+    if (!jump) {
+      pc = (pc == prog->wrap) ? prog->wrap_target : pc + 1;
+    }
+  }
+}
+
+// NRZI line levels of data bits with bit stuffing. Line starts low, which
+// is the level for x == 0 in the decoder. stuff_cnt counts stuffed bits
+// followed by 1, skip_stuff >= 0 leaves that one out.
+static int encode_levels(const uint8_t *bits, int bit_cnt, uint8_t *levels,
+                         int skip_stuff, int *stuff_cnt) {
+  uint8_t level = 0;
+  int ones = 0;
+  int cnt = 0;
+
+  *stuff_cnt = 0;
+  for (int i = 0; i < bit_cnt; i++) {
+    if (!bits[i]) {
+      level ^= 1;
+    }
+    levels[cnt++] = level;
+    ones = bits[i] ? ones + 1 : 0;
+    if (ones == 6) {
+      // only a missing stuffed bit followed by 1 makes 7 1s on the line
+      bool const skip = (i + 1 < bit_cnt) && bits[i + 1] &&
+                        (*stuff_cnt)++ == skip_stuff;
+      if (!skip) {
+        level ^= 1;
+        levels[cnt++] = level;
+      }
+      ones = 0;
+    }
+  }
+
+  return cnt;
+}
+
+int main(void) {
+  static const program_t plain = {
+      usb_nrzi_decoder_program_instructions, usb_nrzi_decoder_wrap_target,
+      usb_nrzi_decoder_wrap, 0};
+  static const program_t bs = {
+      usb_nrzi_decoder_bs_program_instructions,
+      usb_nrzi_decoder_bs_wrap_target, usb_nrzi_decoder_bs_wrap,
+      usb_nrzi_decoder_bs_offset_start};
+  uint8_t bits[BITS_MAX];
+  uint8_t levels[BITS_MAX * 2];
+  decoded_t out_plain;
+  decoded_t out_bs;
+  int fail = 0;
+  int errors_found = 0;
+
+  srand(1);
+  for (int i = 0; i < 20000 && !fail; i++) {
+    int const bit_cnt = 8 + rand() % (64 * 8);
+    int const pattern = rand() % 3;
+    for (int b = 0; b < bit_cnt; b++) {
+      // random, bit stuffing heavy and all 1 data
+      bits[b] = pattern == 0   ? rand() & 1
+                : pattern == 1 ? (rand() % 8 != 0)
+                               : 1;
+    }
+
+    int stuff_cnt;
+    int level_cnt = encode_levels(bits, bit_cnt, levels, -1, &stuff_cnt);
+    if (!run_decoder(&plain, levels, level_cnt, &out_plain) ||
+        !run_decoder(&bs, levels, level_cnt, &out_bs)) {
+      printf("[NG] decoder stalled, %d bits\n", bit_cnt);
+      fail = 1;
+      break;
+    }
+    if (out_plain.bit_cnt != bit_cnt ||
+        memcmp(out_plain.bits, bits, bit_cnt) != 0 ||
+        out_bs.bit_cnt != bit_cnt ||
+        memcmp(out_bs.bits, bits, bit_cnt) != 0) {
+      printf("[NG] %d bits decoded as %d (plain), %d (bs)\n", bit_cnt,
+             out_plain.bit_cnt, out_bs.bit_cnt);
+      fail = 1;
+    }
+    if (out_plain.bs_err || out_bs.bs_err) {
+      printf("[NG] bit stuffing error on valid data, %d bits\n", bit_cnt);
+      fail = 1;
+    }
+
+    if (stuff_cnt == 0) {
+      continue;
+    }
+
+    // 7 consecutive 1s on the line
+    level_cnt =
+        encode_levels(bits, bit_cnt, levels, rand() % stuff_cnt, &stuff_cnt);
+    if (!run_decoder(&plain, levels, level_cnt, &out_plain) ||
+        !run_decoder(&bs, levels, level_cnt, &out_bs)) {
+      printf("[NG] decoder stalled, %d bits\n", bit_cnt);
+      fail = 1;
+      break;
+    }
+    if (out_plain.bs_err || !out_bs.bs_err) {
+      printf("[NG] missing stuffed bit: plain %d, bs %d\n", out_plain.bs_err,
+             out_bs.bs_err);
+      fail = 1;
+    }
+    errors_found++;
+  }
+
+  if (errors_found == 0) {
+    printf("[NG] no bit stuffing error tested\n");
+    fail = 1;
+  }
+
+  printf("rx decoder bit stuffing check: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
@@ -0,0 +1,161 @@
+// Model the NRZI decoder pushing 32bit words and the tail probe at EOP, and
+// check that pio_usb_ll_decode_rx_word / pio_usb_ll_decode_rx_tail give the
+// same bytes and CRC16 result as the 8bit receive loop. A packet longer than
+// the buffer must be counted without writing past the buffer.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pio_usb_ll.h"
+#include "usb_crc.h"
+
+#define PACKET_MAX (2 + 64 + 2)
+
+typedef struct {
+  uint32_t fifo[PACKET_MAX];
+  int fifo_cnt;
+  uint32_t isr;
+  int isr_cnt;
+} decoder_t;
+
+// Shift to right, autopush at 32bit
+static void decoder_bit(decoder_t *dec, int bit) {
+  dec->isr = (dec->isr >> 1) | ((uint32_t)bit << 31);
+  if (++dec->isr_cnt == 32) {
+    dec->fifo[dec->fifo_cnt++] = dec->isr;
+    dec->isr = 0;
+    dec->isr_cnt = 0;
+  }
+}
+
+// PUSH iffull with each probe threshold as push_rx_tail() in pio_usb.c
+static uint8_t decoder_push_tail(decoder_t *dec) {
+  for (int i = 0; i < PIO_USB_RX_TAIL_PROBE_CNT; i++) {
+    if (dec->isr_cnt >= pio_usb_rx_tail_probe[i]) {
+      dec->fifo[dec->fifo_cnt++] = dec->isr;
+      dec->isr = 0;
+      dec->isr_cnt = 0;
+      return pio_usb_rx_tail_probe[i];
+    }
+  }
+  return 0;
+}
+
+// 8bit receive loop result, CRC16 over bytes after SYNC and PID
+static int byte_receive(const uint8_t *packet, int len) {
+  uint16_t crc = 0xffff;
+  for (int idx = 2; idx < len; idx++) {
+    crc = update_usb_crc16(crc, packet[idx]);
+  }
+  return (len >= 4 && crc == USB_CRC16_RESIDUE) ? len - 4 : -1;
+}
+
+// `pre` bytes are pushed by 8bit before the switch to word mode, `stray` bits
+// are decoded from SE0 after the last byte
+static int word_receive(const uint8_t *packet, int len, int pre, int stray,
+                        uint8_t *buffer, uint16_t buffer_len) {
+  decoder_t dec = {0};
+  uint16_t crc = 0xffff;
+  uint16_t idx = 0;
+
+  for (int i = 0; i < pre && i < len; i++) {
+    buffer[idx++] = packet[i];
+  }
+  for (int i = idx; i < len; i++) {
+    for (int b = 0; b < 8; b++) {
+      decoder_bit(&dec, (packet[i] >> b) & 1);
+    }
+  }
+  for (int i = 0; i < stray; i++) {
+    decoder_bit(&dec, rand() & 1);
+  }
+
+  for (int i = 0; i < dec.fifo_cnt; i++) {
+    idx = pio_usb_ll_decode_rx_word(buffer, buffer_len, idx, dec.fifo[i],
+                                    &crc);
+  }
+  dec.fifo_cnt = 0;
+  uint8_t const bits = decoder_push_tail(&dec);
+  if (bits) {
+    idx = pio_usb_ll_decode_rx_tail(buffer, buffer_len, idx, dec.fifo[0], bits,
+                                    &crc);
+  }
+
+  if (idx != len) {
+    return -2;
+  }
+  if (idx > buffer_len) {
+    return -1; // rejected as in receive_packet_word_and_handshake()
+  }
+  return (idx >= 4 && crc == USB_CRC16_RESIDUE) ? idx - 4 : -1;
+}
+
+int main(void) {
+  uint8_t packet[PACKET_MAX];
+  uint8_t buffer[PACKET_MAX + 4];
+  int fail = 0;
+
+  srand(1);
+  for (int i = 0; i < 200000 && !fail; i++) {
+    // handshake only, or DATA packet with 0-64 bytes
+    int const data_len = rand() % 66 - 1;
+    int len;
+    packet[0] = USB_SYNC;
+    if (data_len < 0) {
+      packet[1] = USB_PID_NAK;
+      len = 2;
+    } else {
+      packet[1] = (rand() & 1) ? USB_PID_DATA1 : USB_PID_DATA0;
+      for (int j = 0; j < data_len; j++) {
+        packet[2 + j] = (rand() & 1) ? 0xff : rand();
+      }
+      uint16_t const crc = calc_usb_crc16(&packet[2], data_len);
+      packet[2 + data_len] = crc & 0xff;
+      packet[3 + data_len] = crc >> 8;
+      len = data_len + 4;
+      if (rand() % 4 == 0) {
+        // corrupted packet must be rejected by both
+        packet[2 + rand() % (len - 2)] ^= 1 << (rand() % 8);
+      }
+    }
+
+    int const pre = rand() % 3;
+    int const stray = rand() % 2;
+    memset(buffer, 0, sizeof(buffer));
+    int const expect = byte_receive(packet, len);
+    int const actual =
+        word_receive(packet, len, pre, stray, buffer, sizeof(buffer));
+    if (expect != actual || memcmp(packet, buffer, len) != 0) {
+      printf("[NG] len %d pre %d stray %d: expect %d, actual %d\n", len, pre,
+             stray, expect, actual);
+      fail = 1;
+    }
+
+    // same packet into a shorter buffer: rejected if it does not fit, bytes
+    // of whole words are stored and nothing past the buffer is written
+    uint16_t const short_len = 6 + rand() % (sizeof(buffer) - 6);
+    memset(buffer, 0xa5, sizeof(buffer));
+    int const clipped = word_receive(packet, len, pre, stray, buffer, short_len);
+    int const stored = len < short_len - 3 ? len : short_len - 3;
+    if (clipped != (len <= short_len ? expect : -1) ||
+        memcmp(packet, buffer, stored) != 0) {
+      printf("[NG] len %d into %u: result %d\n", len, short_len, clipped);
+      fail = 1;
+    }
+    for (size_t j = short_len; j < sizeof(buffer); j++) {
+      if (buffer[j] != 0xa5) {
+        printf("[NG] len %d into %u: wrote at %u\n", len, short_len,
+               (unsigned)j);
+        fail = 1;
+        break;
+      }
+    }
+  }
+
+  printf("rx word mode: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}
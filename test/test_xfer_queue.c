@@ -0,0 +1,229 @@
+// Transfer descriptor queue of host endpoints. Frames are simulated against a
+// full-speed bulk IN device which is always ready, with short transfers of
+// one packet each. The task runs once between frames and resubmits what has
+// completed, with a single transfer (pio_usb_ll_transfer_start()) or through
+// the queue, where the next descriptor starts within the same frame.
+//
+// Queue handling is done by the pio_usb_ll_xfer_queue_*() helpers of
+// pio_usb_ll.h as in pio_usb.c, only setting up the endpoint buffer is
+// simulated.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pio_usb_ll.h"
+
+#define FRAME_CNT 1000
+#define BUDGET_US 900
+#define DESC_MAX 16
+#define XFER_LEN 64
+
+typedef struct {
+  pio_usb_xfer_desc_t desc[DESC_MAX];
+  uint8_t buf[DESC_MAX][XFER_LEN];
+  pio_usb_xfer_desc_t *done[DESC_MAX * 2]; // completed, for the task
+  int done_cnt;
+  uint32_t bytes;
+  uint32_t seq;      // next sequence number sent by the device
+  uint32_t expect;   // next sequence number the task expects
+  bool order_err;
+} app_t;
+
+static endpoint_t ep;
+static root_port_t root;
+static spin_lock_t lock;
+
+static void transfer_setup(uint8_t *buf, uint16_t len) {
+  ep.app_buf = buf;
+  ep.total_len = len;
+  ep.actual_len = 0;
+}
+
+// as pio_usb_ll_transfer_enqueue()
+static bool sim_enqueue(pio_usb_xfer_desc_t *desc) {
+  bool start;
+  if (!pio_usb_ll_xfer_queue_add(&ep, &lock, desc, &start)) {
+    return false;
+  }
+  if (start) {
+    transfer_setup(desc->buf, desc->len);
+    ep.has_transfer = true;
+    root.ep_active |= 1;
+  }
+  return true;
+}
+
+// as the queued part of pio_usb_ll_transfer_complete()
+static bool sim_complete(uint32_t flag) {
+  pio_usb_xfer_desc_t *next;
+  pio_usb_xfer_desc_t *flushed;
+  pio_usb_xfer_desc_t *done = pio_usb_ll_xfer_queue_complete(
+      &ep, &lock, &root, 1, flag, &next, &flushed);
+  if (done == NULL) {
+    return false;
+  }
+  if (next) {
+    transfer_setup(next->buf, next->len);
+  }
+  pio_usb_ll_xfer_queue_notify(done, flushed);
+  return true;
+}
+
+static void on_complete(pio_usb_xfer_desc_t *desc) {
+  app_t *app = desc->ctx;
+  app->done[app->done_cnt++] = desc;
+}
+
+// One IN transaction of a full packet carrying the sequence number
+static void sim_transaction(app_t *app, bool queued) {
+  uint16_t const len = pio_usb_ll_get_transaction_len(&ep);
+  memcpy(ep.app_buf, &app->seq, sizeof(app->seq));
+  app->seq++;
+  ep.actual_len += len;
+  ep.data_id ^= 1;
+
+  if (ep.actual_len >= ep.total_len) {
+    if (queued) {
+      sim_complete(PIO_USB_INTS_ENDPOINT_COMPLETE_BITS);
+    } else {
+      ep.has_transfer = false;
+      app->done[app->done_cnt++] = &app->desc[0];
+    }
+  }
+}
+
+// Transactions until the frame budget is used or no transfer is left
+static void sim_frame(app_t *app, bool queued) {
+  uint32_t const xact_us = pio_usb_ll_transaction_time_us(&ep, true);
+  uint32_t now_us = 3 + PIO_USB_TRANSACTION_OVERHEAD_US; // SOF
+
+  while (ep.has_transfer && now_us + xact_us <= BUDGET_US) {
+    sim_transaction(app, queued);
+    now_us += xact_us;
+  }
+}
+
+// Task: consume completed transfers and submit them again
+static void sim_task(app_t *app, bool queued) {
+  for (int i = 0; i < app->done_cnt; i++) {
+    pio_usb_xfer_desc_t *desc = app->done[i];
+    uint32_t seq;
+    memcpy(&seq, desc->buf, sizeof(seq));
+    if (seq != app->expect++) {
+      app->order_err = true;
+    }
+    app->bytes += queued ? desc->actual_len : ep.actual_len;
+
+    if (queued) {
+      sim_enqueue(desc);
+    } else {
+      transfer_setup(desc->buf, desc->len);
+      ep.has_transfer = true;
+    }
+  }
+  app->done_cnt = 0;
+}
+
+static void sim_run(app_t *app, int desc_cnt, bool queued) {
+  memset(app, 0, sizeof(*app));
+  memset(&ep, 0, sizeof(ep));
+  memset(&root, 0, sizeof(root));
+  ep.size = 64;
+  ep.attr = EP_ATTR_BULK;
+  ep.ep_num = 0x81;
+
+  for (int i = 0; i < desc_cnt; i++) {
+    app->desc[i] =
+        (pio_usb_xfer_desc_t){.buf = app->buf[i], .len = XFER_LEN,
+                              .cb = on_complete, .ctx = app};
+    if (queued) {
+      sim_enqueue(&app->desc[i]);
+    }
+  }
+  if (!queued) {
+    transfer_setup(app->desc[0].buf, XFER_LEN);
+    ep.has_transfer = true;
+  }
+
+  for (int f = 0; f < FRAME_CNT; f++) {
+    sim_frame(app, queued);
+    sim_task(app, queued);
+  }
+}
+
+int main(void) {
+  static app_t app;
+  static const int desc_cnts[] = {2, 4, 16};
+  int fail = 0;
+
+  sim_run(&app, 1, false);
+  uint32_t const single = app.bytes;
+  printf("%-12s %10.1f KB/s\n", "single", single / 1000.0 * 1000 / FRAME_CNT);
+
+  for (size_t i = 0; i < sizeof(desc_cnts) / sizeof(desc_cnts[0]); i++) {
+    sim_run(&app, desc_cnts[i], true);
+    printf("queue of %-3d %10.1f KB/s %6.1fx\n", desc_cnts[i],
+           app.bytes / 1000.0 * 1000 / FRAME_CNT, (double)app.bytes / single);
+    if (app.order_err) {
+      printf("[NG] transfers completed out of order\n");
+      fail = 1;
+    }
+    // no gap between queued transfers until the frame budget is used
+    uint32_t const xact_us = pio_usb_ll_transaction_time_us(&ep, true);
+    uint32_t const per_frame =
+        (BUDGET_US - 3 - PIO_USB_TRANSACTION_OVERHEAD_US) / xact_us;
+    uint32_t const expect =
+        desc_cnts[i] < (int)per_frame ? (uint32_t)desc_cnts[i] : per_frame;
+    if (app.bytes < single * expect * 9 / 10) {
+      printf("[NG] queue of %d does not remove the resubmit gap\n",
+             desc_cnts[i]);
+      fail = 1;
+    }
+  }
+
+  // transfer of pio_usb_ll_transfer_start() in progress
+  sim_run(&app, 0, true);
+  transfer_setup(app.buf[0], XFER_LEN);
+  ep.has_transfer = true;
+  if (sim_enqueue(&app.desc[0])) {
+    printf("[NG] queued behind a single transfer\n");
+    fail = 1;
+  }
+
+  // stall completes all queued descriptors
+  sim_run(&app, 0, true);
+  for (int i = 0; i < 4; i++) {
+    app.desc[i] = (pio_usb_xfer_desc_t){.buf = app.buf[i], .len = XFER_LEN,
+                                        .cb = on_complete, .ctx = &app};
+    sim_enqueue(&app.desc[i]);
+  }
+  sim_complete(PIO_USB_INTS_ENDPOINT_STALLED_BITS);
+  if (app.done_cnt != 4 || ep.has_transfer || ep.xfer_head || ep.xfer_tail ||
+      root.ep_active) {
+    printf("[NG] stall: %d completed, transfer %d\n", app.done_cnt,
+           ep.has_transfer);
+    fail = 1;
+  }
+  for (int i = 0; i < app.done_cnt; i++) {
+    if (app.done[i] != &app.desc[i] ||
+        app.done[i]->flag != PIO_USB_INTS_ENDPOINT_STALLED_BITS) {
+      printf("[NG] stall: descriptor %d\n", i);
+      fail = 1;
+    }
+  }
+
+  // queue cancelled on the other core before the transfer completes
+  sim_run(&app, 2, true);
+  ep.xfer_head = NULL;
+  ep.xfer_tail = NULL;
+  if (sim_complete(PIO_USB_INTS_ENDPOINT_COMPLETE_BITS) || app.done_cnt) {
+    printf("[NG] completion of a cancelled queue\n");
+    fail = 1;
+  }
+
+  printf("transfer queue: %s\n", fail ? "[NG]" : "[OK]");
+
+  return fail;
+}